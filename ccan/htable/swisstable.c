@@ -0,0 +1,208 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#include <ccan/htable/swisstable.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Control bytes of free slots: full slots never have the top bit set. */
+#define SWISSTABLE_EMPTY 0x80
+#define SWISSTABLE_DELETED 0xFE
+
+/* The bits of the hash which pick the group, and which go in ctrl[]. */
+static inline size_t hash_group(const struct swisstable *ht, size_t hash)
+{
+	return (hash >> 7) & (((size_t)1 << (ht->bits - 4)) - 1);
+}
+
+static inline uint8_t hash_ctrl(size_t hash)
+{
+	return hash & 0x7F;
+}
+
+/* Bit i set if the group's ith control byte is @c. */
+static inline unsigned int group_match(const uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < SWISSTABLE_GROUP; i++)
+		mask |= (unsigned int)(ctrl[i] == c) << i;
+	return mask;
+#endif
+}
+
+/* Bit i set if the group's ith slot is empty or deleted. */
+static inline unsigned int group_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < SWISSTABLE_GROUP; i++)
+		mask |= (unsigned int)(ctrl[i] >> 7) << i;
+	return mask;
+#endif
+}
+
+static inline unsigned int first_bit(unsigned int mask)
+{
+#if HAVE_BUILTIN_FFSL
+	return __builtin_ffsl(mask) - 1;
+#else
+	unsigned int i;
+
+	for (i = 0; !(mask & (1U << i)); i++);
+	return i;
+#endif
+}
+
+void swisstable_init(struct swisstable *ht)
+{
+	ht->bits = 0;
+	ht->elems = ht->deleted = ht->max = 0;
+	ht->ctrl = NULL;
+	ht->slots = NULL;
+}
+
+void swisstable_clear(struct swisstable *ht)
+{
+	free(ht->ctrl);
+	free(ht->slots);
+	swisstable_init(ht);
+}
+
+/* Put it in the first free slot along its probe sequence. */
+static void st_add(struct swisstable *ht, size_t hash, const void *p)
+{
+	size_t mask = hash_group(ht, SIZE_MAX), g = hash_group(ht, hash), i;
+
+	/* Triangular probing visits every group (there are 2^n of them). */
+	for (i = 1;; i++) {
+		uint8_t *ctrl = ht->ctrl + g * SWISSTABLE_GROUP;
+		unsigned int avail = group_free(ctrl);
+
+		if (avail) {
+			size_t slot = g * SWISSTABLE_GROUP + first_bit(avail);
+
+			if (ht->ctrl[slot] == SWISSTABLE_DELETED)
+				ht->deleted--;
+			ht->ctrl[slot] = hash_ctrl(hash);
+			ht->slots[slot].hash = hash;
+			ht->slots[slot].p = p;
+			return;
+		}
+		g = (g + i) & mask;
+	}
+}
+
+static bool resize_table(struct swisstable *ht, unsigned int bits)
+{
+	struct swisstable old = *ht;
+	size_t i, size = (size_t)1 << bits;
+
+	ht->ctrl = malloc(size);
+	ht->slots = malloc(size * sizeof(*ht->slots));
+	if (!ht->ctrl || !ht->slots) {
+		free(ht->ctrl);
+		free(ht->slots);
+		*ht = old;
+		return false;
+	}
+	memset(ht->ctrl, SWISSTABLE_EMPTY, size);
+	ht->bits = bits;
+	ht->deleted = 0;
+	/* Keep at least one empty slot in each group, on average. */
+	ht->max = size / 8 * 7;
+
+	for (i = 0; i < ((size_t)1 << old.bits) && old.ctrl; i++) {
+		if (!(old.ctrl[i] & 0x80))
+			st_add(ht, old.slots[i].hash, old.slots[i].p);
+	}
+	free(old.ctrl);
+	free(old.slots);
+	return true;
+}
+
+bool swisstable_add(struct swisstable *ht, size_t hash, const void *p)
+{
+	if (ht->elems + ht->deleted + 1 > ht->max) {
+		/* Mostly deleted?  Then clean them out, rather than grow. */
+		unsigned int bits = ht->deleted > ht->elems ? ht->bits
+			: ht->bits ? ht->bits + 1 : 4;
+
+		if (!resize_table(ht, bits))
+			return false;
+	}
+	assert(p);
+	st_add(ht, hash, p);
+	ht->elems++;
+	return true;
+}
+
+void *swisstable_get(const struct swisstable *ht, size_t hash,
+		     bool (*cmp)(const void *candidate, void *ptr),
+		     const void *ptr)
+{
+	size_t mask, g, i;
+
+	if (!ht->elems)
+		return NULL;
+
+	mask = hash_group(ht, SIZE_MAX);
+	g = hash_group(ht, hash);
+	for (i = 1;; i++) {
+		const uint8_t *ctrl = ht->ctrl + g * SWISSTABLE_GROUP;
+		unsigned int match = group_match(ctrl, hash_ctrl(hash));
+
+		while (match) {
+			const struct swisstable_slot *s;
+
+			s = &ht->slots[g * SWISSTABLE_GROUP + first_bit(match)];
+			if (s->hash == hash && cmp(s->p, (void *)ptr))
+				return (void *)s->p;
+			match &= match - 1;
+		}
+		/* An empty slot means it was never pushed past here. */
+		if (group_match(ctrl, SWISSTABLE_EMPTY))
+			return NULL;
+		g = (g + i) & mask;
+	}
+}
+
+bool swisstable_del(struct swisstable *ht, size_t hash, const void *p)
+{
+	size_t mask, g, i;
+
+	if (!ht->elems)
+		return false;
+
+	mask = hash_group(ht, SIZE_MAX);
+	g = hash_group(ht, hash);
+	for (i = 1;; i++) {
+		uint8_t *ctrl = ht->ctrl + g * SWISSTABLE_GROUP;
+		unsigned int match = group_match(ctrl, hash_ctrl(hash));
+
+		while (match) {
+			size_t slot = g * SWISSTABLE_GROUP + first_bit(match);
+
+			if (ht->slots[slot].p == p) {
+				/* Lookups have to keep probing past it. */
+				ht->ctrl[slot] = SWISSTABLE_DELETED;
+				ht->elems--;
+				ht->deleted++;
+				return true;
+			}
+			match &= match - 1;
+		}
+		if (group_match(ctrl, SWISSTABLE_EMPTY))
+			return false;
+		g = (g + i) & mask;
+	}
+}
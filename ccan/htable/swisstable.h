@@ -0,0 +1,139 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#ifndef CCAN_HTABLE_SWISSTABLE_H
+#define CCAN_HTABLE_SWISSTABLE_H
+#include "config.h"
+#include <ccan/htable/htable_type.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Entries are probed in groups of this many control bytes. */
+#define SWISSTABLE_GROUP 16
+
+/**
+ * struct swisstable - private definition of a swisstable.
+ *
+ * An open-addressing table in the style of Abseil's "Swiss tables".
+ * Each slot has a control byte: 0x80 if it's empty, 0xFE if it was
+ * deleted, otherwise the low 7 bits of the hash.  A lookup compares a
+ * whole group of control bytes against those 7 bits at once (with SSE2
+ * where we have it), and only looks at the slots which match.  The full
+ * hash is kept inline beside the pointer, so growing never needs to
+ * recompute it.
+ */
+struct swisstable {
+	unsigned int bits;
+	size_t elems, deleted, max;
+	uint8_t *ctrl;
+	struct swisstable_slot {
+		size_t hash;
+		const void *p;
+	} *slots;
+};
+
+/**
+ * swisstable_init - initialize an empty swisstable.
+ * @ht: the table to initialize
+ */
+void swisstable_init(struct swisstable *ht);
+
+/**
+ * swisstable_clear - empty a swisstable.
+ * @ht: the table to clear
+ *
+ * This doesn't do anything to any pointers left in it.
+ */
+void swisstable_clear(struct swisstable *ht);
+
+/**
+ * swisstable_add - add a pointer into a swisstable.
+ * @ht: the table
+ * @hash: the hash value of the object
+ * @p: the non-NULL pointer
+ *
+ * Returns false only if we run out of memory.
+ */
+bool swisstable_add(struct swisstable *ht, size_t hash, const void *p);
+
+/**
+ * swisstable_get - find an entry in the swisstable.
+ * @ht: the table
+ * @hash: the hash value of the entry
+ * @cmp: the comparison function
+ * @ptr: the pointer to hand to the comparison function.
+ *
+ * Returns the first entry with this hash for which @cmp returns true,
+ * or NULL.
+ */
+void *swisstable_get(const struct swisstable *ht, size_t hash,
+		     bool (*cmp)(const void *candidate, void *ptr),
+		     const void *ptr);
+
+/**
+ * swisstable_del - remove a pointer from a swisstable
+ * @ht: the table
+ * @hash: the hash value of the object
+ * @p: the pointer
+ *
+ * Returns true if the pointer was found (and deleted).
+ */
+bool swisstable_del(struct swisstable *ht, size_t hash, const void *p);
+
+/**
+ * SWISSTABLE_DEFINE_TYPE - create a set of swisstable ops for a type
+ * @type: a type whose pointers will be values in the table.
+ * @keyof: a function/macro to extract a key from a @type element.
+ * @hashfn: a hash function for a @key
+ * @eqfn: an equality function keys
+ * @name: a name for all the functions to define (of form <name>_*)
+ *
+ * This is a drop-in for the HTABLE_DEFINE_TYPE() functions other than
+ * iteration and delkey: you can switch a table between the two.
+ *
+ * It defines the table type as follows:
+ *	struct <name>;
+ *
+ * It also defines initialization and freeing functions:
+ *	void <name>_init(struct <name> *ht);
+ *	void <name>_clear(struct <name> *ht);
+ *
+ * Add function only fails if we run out of memory:
+ *	bool <name>_add(struct <name> *ht, const <type> *e);
+ *
+ * Delete function returns false if the element wasn't there:
+ *	bool <name>_del(struct <name> *ht, const <type> *e);
+ *
+ * Find function return the matching element, or NULL:
+ *	type *<name>_get(const struct @name *ht, const <keytype> k);
+ */
+#define SWISSTABLE_DEFINE_TYPE(type, keyof, hashfn, eqfn, name)	\
+	struct name { struct swisstable raw; };				\
+	static inline void name##_init(struct name *ht)			\
+	{								\
+		swisstable_init(&ht->raw);				\
+	}								\
+	static inline void name##_clear(struct name *ht)		\
+	{								\
+		swisstable_clear(&ht->raw);				\
+	}								\
+	static inline bool name##_add(struct name *ht, const type *elem) \
+	{								\
+		return swisstable_add(&ht->raw, hashfn(keyof(elem)), elem); \
+	}								\
+	static inline bool name##_del(struct name *ht, const type *elem) \
+	{								\
+		return swisstable_del(&ht->raw, hashfn(keyof(elem)), elem); \
+	}								\
+	static inline type *name##_get(const struct name *ht,		\
+				       const HTABLE_KTYPE(keyof) k)	\
+	{								\
+		/* Typecheck for eqfn */				\
+		(void)sizeof(eqfn((const type *)NULL,			\
+				  keyof((const type *)NULL)));		\
+		return swisstable_get(&ht->raw,				\
+				      hashfn(k),			\
+				      (bool (*)(const void *, void *))(eqfn), \
+				      k);				\
+	}
+
+#endif /* CCAN_HTABLE_SWISSTABLE_H */
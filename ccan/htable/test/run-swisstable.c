@@ -0,0 +1,69 @@
+#include <ccan/htable/swisstable.h>
+#include <ccan/htable/swisstable.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_VALS 512
+
+/* We use the number divided by four as the hash (for lots of
+   collisions), shifted so the control byte is always the same. */
+static size_t hash(const uint64_t *elem)
+{
+	return (*elem / 4) << 7;
+}
+
+static bool eq(const void *e, void *k)
+{
+	return *(const uint64_t *)e == *(uint64_t *)k;
+}
+
+int main(int argc, char *argv[])
+{
+	struct swisstable ht;
+	uint64_t val[NUM_VALS], dne = NUM_VALS * 2;
+	unsigned int i;
+	bool all;
+
+	plan_tests(12);
+	for (i = 0; i < NUM_VALS; i++)
+		val[i] = i;
+
+	swisstable_init(&ht);
+	ok1(!swisstable_get(&ht, hash(&val[0]), eq, &val[0]));
+	ok1(!swisstable_del(&ht, hash(&val[0]), &val[0]));
+
+	for (i = 0; i < NUM_VALS; i++)
+		swisstable_add(&ht, hash(&val[i]), &val[i]);
+	ok1(ht.elems == NUM_VALS);
+	ok1(ht.max >= NUM_VALS);
+
+	for (all = true, i = 0; i < NUM_VALS; i++)
+		all &= (swisstable_get(&ht, hash(&val[i]), eq, &val[i])
+			== &val[i]);
+	ok1(all);
+	ok1(!swisstable_get(&ht, hash(&dne), eq, &dne));
+
+	/* Delete the even ones: the odd ones are still found past them. */
+	for (all = true, i = 0; i < NUM_VALS; i += 2)
+		all &= swisstable_del(&ht, hash(&val[i]), &val[i]);
+	ok1(all);
+	ok1(!swisstable_del(&ht, hash(&val[0]), &val[0]));
+	for (all = true, i = 0; i < NUM_VALS; i++)
+		all &= (swisstable_get(&ht, hash(&val[i]), eq, &val[i])
+			== (i % 2 ? &val[i] : NULL));
+	ok1(all);
+	ok1(ht.elems == NUM_VALS / 2 && ht.deleted == NUM_VALS / 2);
+
+	/* Adding them back reuses the deleted slots. */
+	for (i = 0; i < NUM_VALS; i += 2)
+		swisstable_add(&ht, hash(&val[i]), &val[i]);
+	ok1(ht.elems + ht.deleted <= ht.max);
+	for (all = true, i = 0; i < NUM_VALS; i++)
+		all &= (swisstable_get(&ht, hash(&val[i]), eq, &val[i])
+			== &val[i]);
+	ok1(all);
+	swisstable_clear(&ht);
+
+	return exit_status();
+}
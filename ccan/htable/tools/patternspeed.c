@@ -0,0 +1,201 @@
+/* Speed test of htable vs swisstable, using the patterns of a log file.
+ *
+ * Each line becomes a pattern key the way stats(1) sees it: runs of
+ * digits (with an optional sign and fraction) are replaced by '#'.  The
+ * distinct keys are inserted into both tables, then every line's key is
+ * looked up in file order (the access pattern stats(1) has), then keys
+ * which aren't there. */
+#include <ccan/htable/htable_type.h>
+#include <ccan/htable/htable.c>
+#include <ccan/htable/swisstable.h>
+#include <ccan/htable/swisstable.c>
+#include <ccan/hash/hash.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static const char *strkey(const char *str)
+{
+	return str;
+}
+
+static size_t hash_str(const char *key)
+{
+	return hash(key, strlen(key), 0);
+}
+
+static bool cmp(const char *obj, const char *key)
+{
+	return strcmp(obj, key) == 0;
+}
+
+HTABLE_DEFINE_TYPE(char, strkey, hash_str, cmp, htable_str);
+SWISSTABLE_DEFINE_TYPE(char, strkey, hash_str, cmp, swiss_str);
+
+/* Nanoseconds per operation */
+static size_t normalize(const struct timeval *start,
+			const struct timeval *stop,
+			unsigned int num)
+{
+	struct timeval diff;
+
+	timersub(stop, start, &diff);
+
+	/* Floating point is more accurate here. */
+	return (double)(diff.tv_sec * 1000000 + diff.tv_usec)
+		/ num * 1000;
+}
+
+static struct timeval time_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now;
+}
+
+/* Replace the numbers in line with '#', in place. */
+static char *pattern_key(char *line)
+{
+	char *in = line, *out = line;
+
+	while (*in) {
+		const char *p = in;
+
+		if (*p == '-' || *p == '+')
+			p++;
+		if (isdigit((unsigned char)*p)) {
+			while (isdigit((unsigned char)*p))
+				p++;
+			if (*p == '.' && isdigit((unsigned char)p[1])) {
+				p++;
+				while (isdigit((unsigned char)*p))
+					p++;
+			}
+			*(out++) = '#';
+			in = (char *)p;
+		} else
+			*(out++) = *(in++);
+	}
+	*out = '\0';
+	return line;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i, num = 0, max = 0, distinct = 0, found;
+	struct timeval start, stop;
+	struct htable_str ht;
+	struct swiss_str st;
+	char **keys = NULL, **uniq, **miss, *line = NULL;
+	size_t linelen = 0;
+	ssize_t len;
+	FILE *f = argv[1] ? fopen(argv[1], "r") : stdin;
+
+	if (!f) {
+		perror(argv[1]);
+		exit(1);
+	}
+	htable_str_init(&ht);
+	while ((len = getline(&line, &linelen, f)) > 0) {
+		char *key;
+
+		if (line[len-1] == '\n')
+			line[len-1] = '\0';
+		if (num == max) {
+			max = max ? max * 2 : 1024;
+			keys = realloc(keys, max * sizeof(*keys));
+		}
+		pattern_key(line);
+		/* Share the string for repeated patterns. */
+		key = htable_str_get(&ht, line);
+		if (!key) {
+			key = strdup(line);
+			htable_str_add(&ht, key);
+			distinct++;
+		}
+		keys[num++] = key;
+	}
+	htable_str_clear(&ht);
+	printf("%zu lines, %zu patterns\n", num, distinct);
+	if (!distinct)
+		return 0;
+
+	uniq = malloc(distinct * sizeof(*uniq));
+	miss = malloc(distinct * sizeof(*miss));
+	htable_str_init(&ht);
+	for (i = distinct = 0; i < num; i++) {
+		if (!htable_str_get(&ht, keys[i])) {
+			htable_str_add(&ht, keys[i]);
+			uniq[distinct] = keys[i];
+			/* Same pattern with an extra literal on the end. */
+			miss[distinct] = malloc(strlen(keys[i]) + 2);
+			sprintf(miss[distinct], "%s!", keys[i]);
+			distinct++;
+		}
+	}
+	htable_str_clear(&ht);
+
+	printf("#01: Initial insert: ");
+	fflush(stdout);
+	htable_str_init(&ht);
+	start = time_now();
+	for (i = 0; i < distinct; i++)
+		htable_str_add(&ht, uniq[i]);
+	stop = time_now();
+	printf(" htable %zu ns,", normalize(&start, &stop, distinct));
+	swiss_str_init(&st);
+	start = time_now();
+	for (i = 0; i < distinct; i++)
+		swiss_str_add(&st, uniq[i]);
+	stop = time_now();
+	printf(" swisstable %zu ns\n", normalize(&start, &stop, distinct));
+
+	printf("#02: Lookup each line: ");
+	fflush(stdout);
+	found = 0;
+	start = time_now();
+	for (i = 0; i < num; i++)
+		found += (htable_str_get(&ht, keys[i]) == keys[i]);
+	stop = time_now();
+	if (found != num)
+		abort();
+	printf(" htable %zu ns,", normalize(&start, &stop, num));
+	found = 0;
+	start = time_now();
+	for (i = 0; i < num; i++)
+		found += (swiss_str_get(&st, keys[i]) == keys[i]);
+	stop = time_now();
+	if (found != num)
+		abort();
+	printf(" swisstable %zu ns\n", normalize(&start, &stop, num));
+
+	printf("#03: Lookup misses: ");
+	fflush(stdout);
+	start = time_now();
+	for (i = 0; i < distinct; i++)
+		if (htable_str_get(&ht, miss[i]))
+			abort();
+	stop = time_now();
+	printf(" htable %zu ns,", normalize(&start, &stop, distinct));
+	start = time_now();
+	for (i = 0; i < distinct; i++)
+		if (swiss_str_get(&st, miss[i]))
+			abort();
+	stop = time_now();
+	printf(" swisstable %zu ns\n", normalize(&start, &stop, distinct));
+
+	htable_str_clear(&ht);
+	swiss_str_clear(&st);
+	for (i = 0; i < distinct; i++) {
+		free(uniq[i]);
+		free(miss[i]);
+	}
+	free(uniq);
+	free(miss);
+	free(keys);
+	free(line);
+	return 0;
+}
@@ -50,17 +50,50 @@ static bool enlarge_buf(struct rbuf *buf, size_t len,
 	return true;
 }
 
+/* We've hit the end of the buffer: compact, or enlarge it. */
+static bool make_room(struct rbuf *buf,
+		      void *(*resize)(void *buf, size_t len))
+{
+	size_t size = buf->buf_end - buf->buf;
+	bool at_max = buf->max && size >= buf->max;
+
+	/* Moving at most half a buffer's worth is cheaper than growing. */
+	if (buf->start != buf->buf && (buf->len <= size / 2 || at_max)) {
+		memmove(buf->buf, buf->start, buf->len);
+		buf->bytes_copied += buf->len;
+		buf->start = buf->buf;
+		return true;
+	}
+
+	if (at_max) {
+		errno = ENOBUFS;
+		return false;
+	}
+
+	size = size ? size * 2 : rbuf_good_size(buf->fd);
+	if (buf->max && size > buf->max)
+		size = buf->max;
+	if (!enlarge_buf(buf, size, resize))
+		return false;
+	buf->grows++;
+	return true;
+}
+
 static ssize_t get_more(struct rbuf *rbuf,
 			void *(*resize)(void *buf, size_t len))
 {
-	size_t r;
+	ssize_t r;
 
 	if (rbuf->start + rbuf->len == rbuf->buf_end) {
-		if (!enlarge_buf(rbuf, (rbuf->buf_end - rbuf->buf) * 2, resize))
+		if (!make_room(rbuf, resize))
 			return -1;
 	}
 
-	r = read(rbuf->fd, rbuf->start + rbuf->len, rem(rbuf));
+	if (rbuf->readfn)
+		r = rbuf->readfn(rbuf->readfn_arg,
+				 rbuf->start + rbuf->len, rem(rbuf));
+	else
+		r = read(rbuf->fd, rbuf->start + rbuf->len, rem(rbuf));
 	if (r <= 0)
 		return r;
 
@@ -5,10 +5,15 @@
 #include <limits.h> // For UCHAR_MAX
 #include <assert.h>
 #include <stdbool.h>
+#include <sys/types.h> // For ssize_t
 
 struct rbuf {
 	int fd;
 
+	/* If non-NULL, used instead of read() on fd. */
+	ssize_t (*readfn)(void *arg, void *buf, size_t len);
+	void *readfn_arg;
+
 	/* Where to read next. */
 	char *start;
 	/* How much of what is there is valid. */
@@ -16,6 +21,13 @@ struct rbuf {
 
 	/* The entire buffer memory we have to work with. */
 	char *buf, *buf_end;
+
+	/* Maximum size to enlarge the buffer to (0 == unlimited). */
+	size_t max;
+
+	/* Statistics: bytes moved to the front of the buffer, and
+	 * number of times the buffer was enlarged. */
+	size_t bytes_copied, grows;
 };
 
 /**
@@ -29,9 +41,59 @@ static inline void rbuf_init(struct rbuf *buf,
 			     int fd, char *buffer, size_t buf_max)
 {
 	buf->fd = fd;
+	buf->readfn = NULL;
 	buf->start = buf->buf = buffer;
 	buf->len = 0;
 	buf->buf_end = buffer + buf_max;
+	buf->max = 0;
+	buf->bytes_copied = buf->grows = 0;
+}
+
+/**
+ * rbuf_set_max - limit how large the buffer can grow.
+ * @buf: the struct rbuf.
+ * @max: the maximum size, or 0 for no limit.
+ *
+ * When the end of the buffer is reached, unconsumed data is moved
+ * back to the front if that's cheap (at most half the buffer is in
+ * use), otherwise the buffer is doubled.  Once it is @max bytes, data
+ * is always moved instead, and if the buffer is entirely unconsumed
+ * data, reading fails with errno set to ENOBUFS.
+ *
+ * Example:
+ *	// No line can be longer than 1MB.
+ *	rbuf_set_max(&in, 1024 * 1024);
+ */
+static inline void rbuf_set_max(struct rbuf *buf, size_t max)
+{
+	buf->max = max;
+}
+
+/**
+ * rbuf_set_readfn - get data from a function instead of read().
+ * @buf: the struct rbuf.
+ * @readfn: the function, which acts like read() (-1 and errno on error).
+ * @arg: the first argument to hand to @readfn.
+ *
+ * This is useful for data which needs transforming, such as decompression.
+ * @buf->fd is only used for rbuf_good_size().
+ *
+ * Example:
+ *	static ssize_t read_zeroes(void *arg, void *buf, size_t len)
+ *	{
+ *		memset(buf, 0, len);
+ *		return len;
+ *	}
+ *	...
+ *	rbuf_set_readfn(&in, read_zeroes, NULL);
+ */
+static inline void rbuf_set_readfn(struct rbuf *buf,
+				   ssize_t (*readfn)(void *arg,
+						     void *buf, size_t len),
+				   void *arg)
+{
+	buf->readfn = readfn;
+	buf->readfn_arg = arg;
 }
 
 /**
@@ -123,8 +185,10 @@ void *rbuf_fill_all(struct rbuf *rbuf, void *(*resize)(void *buf, size_t len));
  * @resize: the call to resize the buffer.
  *
  * If @resize is needed and is NULL, or returns false, rbuf_read_str
- * will return NULL (with errno set to ENOMEM).  If a read fails,
- * then NULL is also returned, otherwise the next string.  It
+ * will return NULL (with errno set to ENOMEM); if the buffer would
+ * have to grow beyond the limit set by rbuf_set_max(), errno is
+ * ENOBUFS.  If a read fails, then NULL is also returned, otherwise
+ * the next string.  It
  * replaces the terminator @term (if any) with NUL, otherwise NUL
  * is placed after EOF.  If you need to, you can tell this has happened
  * because the nul terminator will be at @buf->start (normally it will
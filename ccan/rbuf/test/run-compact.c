@@ -0,0 +1,57 @@
+#include <ccan/rbuf/rbuf.h>
+/* Include the C files directly. */
+#include <ccan/rbuf/rbuf.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+
+/* Endless 100-character lines (or one endless line if @arg is NULL). */
+static ssize_t read_lines(void *arg, void *buf, size_t len)
+{
+	size_t *off = arg, i;
+	char *p = buf;
+
+	for (i = 0; i < len; i++) {
+		if (off)
+			p[i] = ((*off)++ % 100 == 99) ? '\n' : 'x';
+		else
+			p[i] = 'x';
+	}
+	return len;
+}
+
+int main(void)
+{
+	struct rbuf in;
+	size_t off = 0, i;
+	char *p;
+
+	/* This is how many tests you plan to run */
+	plan_tests(8);
+
+	/* Lots of lines through a small buffer: it shouldn't keep growing. */
+	rbuf_init(&in, -1, malloc(256), 256);
+	rbuf_set_readfn(&in, read_lines, &off);
+	for (i = 0; i < 100000; i++) {
+		p = rbuf_read_str(&in, '\n', realloc);
+		if (!p || strlen(p) != 99)
+			break;
+	}
+	ok1(i == 100000);
+	ok1(in.buf_end - in.buf == 256);
+	ok1(in.grows == 0);
+	ok1(in.bytes_copied > 0);
+	free(in.buf);
+
+	/* A line longer than the maximum. */
+	rbuf_init(&in, -1, malloc(256), 256);
+	rbuf_set_readfn(&in, read_lines, NULL);
+	rbuf_set_max(&in, 1000);
+	p = rbuf_read_str(&in, '\n', realloc);
+	ok1(!p);
+	ok1(errno == ENOBUFS);
+	ok1(in.buf_end - in.buf == 1000);
+	ok1(in.grows == 2);
+	free(in.buf);
+
+	return exit_status();
+}
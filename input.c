@@ -0,0 +1,776 @@
+/* Licensed under GPLv3 (or any later version) - see LICENSE file for details */
+#include "input.h"
+#include <ccan/err/err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#if HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if HAVE_LZMA
+#include <lzma.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+enum format {
+	GZIP,
+	XZ,
+	ZSTD
+};
+
+static const struct magic {
+	enum format format;
+	const char *name;
+	bool supported;
+	size_t len;
+	unsigned char bytes[6];
+} magics[] = {
+	{ GZIP, "gzip", HAVE_ZLIB, 2, { 0x1f, 0x8b } },
+	{ XZ, "xz", HAVE_LZMA, 6, { 0xfd, '7', 'z', 'X', 'Z', 0x00 } },
+	{ ZSTD, "zstd", HAVE_ZSTD, 4, { 0x28, 0xb5, 0x2f, 0xfd } },
+};
+
+/*
+ * The decompression thread fills a small ring of blocks, so it runs
+ * ahead of (and concurrently with) whoever is consuming the data.
+ */
+#define DEC_BLOCKS 4
+#define DEC_BLOCK_SIZE (256 * 1024)
+#define DEC_INPUT_SIZE (128 * 1024)
+
+struct dec_block {
+	size_t len;
+	unsigned char data[DEC_BLOCK_SIZE];
+};
+
+struct decompressor {
+	struct input *in;
+	const struct magic *magic;
+	pthread_t thread;
+
+	/* Compressed data, only touched by the decompression thread. */
+	unsigned char inbuf[DEC_INPUT_SIZE];
+
+	pthread_mutex_t lock;
+	/* Signalled on any change to the fields below. */
+	pthread_cond_t changed;
+	/* Counts of blocks handed over by the thread, and used up. */
+	size_t produced, consumed;
+	/* Set by the thread when it's finished (with errnum if it failed). */
+	bool done;
+	int errnum;
+	/* Set by input_close() to tell the thread to give up. */
+	bool stop;
+
+	/* How far into the block we're consuming we've read. */
+	size_t consumed_off;
+
+	struct dec_block block[DEC_BLOCKS];
+};
+
+/*
+ * io_uring reader: keeps URING_DEPTH large reads in flight, so the
+ * kernel is fetching the next buffers while we consume this one.  We use
+ * the raw system calls, rather than requiring liburing.
+ */
+#if HAVE_IO_URING
+#define URING_DEPTH 4
+#define URING_BUF_SIZE (1024 * 1024)
+
+struct uring_buf {
+	struct iovec iov;
+	off_t offset;
+	/* Result of the read, once it's no longer pending. */
+	ssize_t len;
+	bool pending;
+};
+
+struct uring {
+	int ring_fd;
+	int fd;
+	/* Regular files get explicit offsets; others just one read at once. */
+	bool seekable;
+	unsigned int depth;
+	/* Offset for the next read, and of the next byte we want. */
+	off_t submit_off, pos;
+	/* Buffer we're consuming from, and how far into it we are. */
+	unsigned int cur;
+	size_t cur_off;
+
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+
+	struct uring_buf buf[URING_DEPTH];
+};
+
+static int uring_enter(struct uring *u, unsigned int submit,
+		       unsigned int wait)
+{
+	long r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, u->ring_fd, submit, wait,
+			    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (r < 0 && errno == EINTR);
+	return r < 0 ? -1 : 0;
+}
+
+static int uring_submit(struct uring *u, unsigned int i, off_t offset)
+{
+	unsigned int tail = *u->sq_tail, idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = u->fd;
+	sqe->addr = (uintptr_t)&u->buf[i].iov;
+	sqe->len = 1;
+	sqe->off = u->seekable ? (uint64_t)offset : (uint64_t)-1;
+	sqe->user_data = i;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	u->buf[i].offset = offset;
+	u->buf[i].pending = true;
+	return uring_enter(u, 1, 0);
+}
+
+/* Queue the next read into buffer i. */
+static int uring_submit_next(struct uring *u, unsigned int i)
+{
+	off_t offset = u->submit_off;
+
+	u->submit_off += URING_BUF_SIZE;
+	return uring_submit(u, i, offset);
+}
+
+static void uring_reap(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+		u->buf[cqe->user_data].len = cqe->res;
+		u->buf[cqe->user_data].pending = false;
+		head++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_wait(struct uring *u, unsigned int i)
+{
+	for (;;) {
+		uring_reap(u);
+		if (!u->buf[i].pending)
+			return 0;
+		if (uring_enter(u, 0, 1) != 0)
+			return -1;
+	}
+}
+
+static ssize_t uring_read(struct uring *u, void *buf, size_t len)
+{
+	for (;;) {
+		struct uring_buf *b = &u->buf[u->cur];
+
+		if (uring_wait(u, u->cur) != 0)
+			return -1;
+
+		if (b->len == -EINTR || b->len == -EAGAIN) {
+			if (uring_submit(u, u->cur, b->offset) != 0)
+				return -1;
+			continue;
+		}
+		if (b->len < 0) {
+			errno = -b->len;
+			return -1;
+		}
+		/* Read beyond a short read: throw it away and reuse buffer. */
+		if (u->seekable && !u->cur_off && b->offset != u->pos) {
+			if (uring_submit_next(u, u->cur) != 0)
+				return -1;
+			u->cur = (u->cur + 1) % u->depth;
+			continue;
+		}
+		if (b->len == 0)
+			return 0;
+
+		if (len > b->len - u->cur_off)
+			len = b->len - u->cur_off;
+		memcpy(buf, (char *)b->iov.iov_base + u->cur_off, len);
+		u->cur_off += len;
+		u->pos += len;
+
+		if (u->cur_off == b->len) {
+			/* Short read: later buffers were read from the wrong
+			 * offset, so restart from here. */
+			if (b->len < URING_BUF_SIZE)
+				u->submit_off = u->pos;
+			u->cur_off = 0;
+			if (uring_submit_next(u, u->cur) != 0)
+				return -1;
+			u->cur = (u->cur + 1) % u->depth;
+		}
+		return len;
+	}
+}
+
+static void uring_free(struct uring *u)
+{
+	unsigned int i;
+
+	/* The kernel may still be writing into these. */
+	for (i = 0; i < u->depth; i++) {
+		if (u->buf[i].pending)
+			uring_wait(u, i);
+		free(u->buf[i].iov.iov_base);
+	}
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ring)
+		munmap(u->cq_ring, u->cq_ring_len);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_len);
+	close(u->ring_fd);
+	free(u);
+}
+
+static void *ring_map(int ring_fd, size_t len, off_t offset)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static struct uring *uring_new(int fd)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	struct stat st;
+	unsigned int i;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+	if (u->ring_fd < 0) {
+		free(u);
+		return NULL;
+	}
+
+	u->fd = fd;
+	u->seekable = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+	u->depth = u->seekable ? URING_DEPTH : 1;
+	if (u->seekable) {
+		/* We may have read the first few bytes already. */
+		u->pos = u->submit_off = lseek(fd, 0, SEEK_CUR);
+		if (u->pos < 0)
+			goto fail;
+	}
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_len = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_ring = ring_map(u->ring_fd, u->sq_ring_len, IORING_OFF_SQ_RING);
+	u->cq_ring = ring_map(u->ring_fd, u->cq_ring_len, IORING_OFF_CQ_RING);
+	u->sqes = ring_map(u->ring_fd, u->sqes_len, IORING_OFF_SQES);
+	if (!u->sq_ring || !u->cq_ring || !u->sqes)
+		goto fail;
+
+	u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	for (i = 0; i < u->depth; i++) {
+		u->buf[i].iov.iov_len = URING_BUF_SIZE;
+		u->buf[i].iov.iov_base = malloc(URING_BUF_SIZE);
+		if (!u->buf[i].iov.iov_base)
+			goto fail;
+	}
+	for (i = 0; i < u->depth; i++)
+		if (uring_submit_next(u, i) != 0)
+			goto fail;
+	return u;
+
+fail:
+	uring_free(u);
+	return NULL;
+}
+#else
+/* Built without it: input_init() warns, and uses read(). */
+static struct uring *uring_new(int fd)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+static ssize_t uring_read(struct uring *u, void *buf, size_t len)
+{
+	abort();
+}
+
+static void uring_free(struct uring *u)
+{
+}
+#endif
+
+/* Read the raw bytes, starting with any we read to check the format. */
+static ssize_t raw_read(struct input *in, void *buf, size_t len)
+{
+	ssize_t r;
+
+	if (in->peek_off < in->peek_len) {
+		r = in->peek_len - in->peek_off;
+		if (r > len)
+			r = len;
+		memcpy(buf, in->peek + in->peek_off, r);
+		in->peek_off += r;
+		return r;
+	}
+
+	if (in->uring)
+		return uring_read(in->uring, buf, len);
+
+	do {
+		r = read(in->fd, buf, len);
+	} while (r < 0 && errno == EINTR);
+	return r;
+}
+
+/* Get a block to decompress into: NULL if we've been told to stop. */
+static struct dec_block *dec_block_get(struct decompressor *d)
+{
+	struct dec_block *b;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->produced - d->consumed == DEC_BLOCKS && !d->stop)
+		pthread_cond_wait(&d->changed, &d->lock);
+	b = d->stop ? NULL : &d->block[d->produced % DEC_BLOCKS];
+	pthread_mutex_unlock(&d->lock);
+	return b;
+}
+
+/* Hand over the current block (if not empty), and get the next. */
+static struct dec_block *dec_block_put(struct decompressor *d,
+				       struct dec_block *b, size_t len)
+{
+	if (!len)
+		return b;
+
+	b->len = len;
+	pthread_mutex_lock(&d->lock);
+	d->produced++;
+	pthread_cond_broadcast(&d->changed);
+	pthread_mutex_unlock(&d->lock);
+	return dec_block_get(d);
+}
+
+static int dec_corrupt(const struct decompressor *d, const char *why)
+{
+	warnx("%s decompression failed: %s", d->magic->name, why);
+	return EIO;
+}
+
+#if HAVE_ZLIB
+static int gunzip(struct decompressor *d)
+{
+	struct dec_block *b;
+	z_stream z;
+	int ret = Z_OK, errnum = 0;
+	bool full = false;
+
+	memset(&z, 0, sizeof(z));
+	/* 15 bit window, +16 means gzip format. */
+	if (inflateInit2(&z, 15 + 16) != Z_OK)
+		return ENOMEM;
+
+	b = dec_block_get(d);
+	z.next_out = b ? b->data : NULL;
+	z.avail_out = DEC_BLOCK_SIZE;
+	while (b) {
+		ssize_t r = 1;
+
+		if (ret == Z_STREAM_END) {
+			/* gzip files can be concatenated. */
+			if (!z.avail_in) {
+				r = raw_read(d->in, d->inbuf, sizeof(d->inbuf));
+				z.next_in = d->inbuf;
+				z.avail_in = r > 0 ? r : 0;
+			}
+			if (r > 0)
+				inflateReset(&z);
+		} else if (!z.avail_in && !full) {
+			r = raw_read(d->in, d->inbuf, sizeof(d->inbuf));
+			z.next_in = d->inbuf;
+			z.avail_in = r > 0 ? r : 0;
+			if (r == 0)
+				errnum = dec_corrupt(d, "unexpected end of file");
+		}
+		if (r < 0)
+			errnum = errno;
+		if (r <= 0)
+			break;
+
+		ret = inflate(&z, Z_NO_FLUSH);
+		/* No progress possible: just needs more input. */
+		if (ret == Z_BUF_ERROR)
+			ret = Z_OK;
+		else if (ret != Z_OK && ret != Z_STREAM_END) {
+			errnum = dec_corrupt(d, z.msg ? z.msg : "corrupt data");
+			break;
+		}
+
+		full = !z.avail_out;
+		if (full) {
+			b = dec_block_put(d, b, DEC_BLOCK_SIZE);
+			z.next_out = b ? b->data : NULL;
+			z.avail_out = DEC_BLOCK_SIZE;
+		}
+	}
+	if (b)
+		dec_block_put(d, b, DEC_BLOCK_SIZE - z.avail_out);
+	inflateEnd(&z);
+	return errnum;
+}
+#endif /* HAVE_ZLIB */
+
+#if HAVE_LZMA
+static int unxz(struct decompressor *d)
+{
+	struct dec_block *b;
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	lzma_ret ret;
+	int errnum = 0;
+
+	/* Like xz(1), handle concatenated .xz files. */
+	if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED)
+	    != LZMA_OK)
+		return ENOMEM;
+
+	b = dec_block_get(d);
+	strm.next_out = b ? b->data : NULL;
+	strm.avail_out = DEC_BLOCK_SIZE;
+	while (b) {
+		if (!strm.avail_in && action == LZMA_RUN) {
+			ssize_t r = raw_read(d->in, d->inbuf, sizeof(d->inbuf));
+			if (r < 0) {
+				errnum = errno;
+				break;
+			}
+			if (r == 0)
+				action = LZMA_FINISH;
+			strm.next_in = d->inbuf;
+			strm.avail_in = r;
+		}
+
+		ret = lzma_code(&strm, action);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+			errnum = dec_corrupt(d, ret == LZMA_BUF_ERROR
+					     ? "unexpected end of file"
+					     : "corrupt data");
+			break;
+		}
+		if (!strm.avail_out || ret == LZMA_STREAM_END) {
+			b = dec_block_put(d, b, DEC_BLOCK_SIZE - strm.avail_out);
+			strm.next_out = b ? b->data : NULL;
+			strm.avail_out = DEC_BLOCK_SIZE;
+		}
+		if (ret == LZMA_STREAM_END)
+			break;
+	}
+	lzma_end(&strm);
+	return errnum;
+}
+#endif /* HAVE_LZMA */
+
+#if HAVE_ZSTD
+static int unzstd(struct decompressor *d)
+{
+	struct dec_block *b;
+	ZSTD_DStream *z = ZSTD_createDStream();
+	ZSTD_inBuffer zin = { d->inbuf, 0, 0 };
+	ZSTD_outBuffer zout;
+	/* 0 means "a frame is complete". */
+	size_t ret = 0;
+	int errnum = 0;
+	bool full = false;
+
+	if (!z)
+		return ENOMEM;
+	ZSTD_initDStream(z);
+
+	b = dec_block_get(d);
+	zout.dst = b ? b->data : NULL;
+	zout.size = DEC_BLOCK_SIZE;
+	zout.pos = 0;
+	while (b) {
+		if (zin.pos == zin.size && !full) {
+			ssize_t r = raw_read(d->in, d->inbuf, sizeof(d->inbuf));
+			if (r < 0) {
+				errnum = errno;
+				break;
+			}
+			if (r == 0) {
+				if (ret != 0)
+					errnum = dec_corrupt(d, "unexpected end"
+							     " of file");
+				break;
+			}
+			zin.size = r;
+			zin.pos = 0;
+		}
+
+		ret = ZSTD_decompressStream(z, &zout, &zin);
+		if (ZSTD_isError(ret)) {
+			errnum = dec_corrupt(d, ZSTD_getErrorName(ret));
+			break;
+		}
+
+		full = (zout.pos == zout.size);
+		if (full) {
+			b = dec_block_put(d, b, zout.pos);
+			zout.dst = b ? b->data : NULL;
+			zout.pos = 0;
+		}
+	}
+	if (b)
+		dec_block_put(d, b, zout.pos);
+	ZSTD_freeDStream(z);
+	return errnum;
+}
+#endif /* HAVE_ZSTD */
+
+static void *decompress_thread(void *arg)
+{
+	struct decompressor *d = arg;
+	int errnum;
+
+	switch (d->magic->format) {
+#if HAVE_ZLIB
+	case GZIP:
+		errnum = gunzip(d);
+		break;
+#endif
+#if HAVE_LZMA
+	case XZ:
+		errnum = unxz(d);
+		break;
+#endif
+#if HAVE_ZSTD
+	case ZSTD:
+		errnum = unzstd(d);
+		break;
+#endif
+	default:
+		abort();
+	}
+
+	pthread_mutex_lock(&d->lock);
+	d->done = true;
+	d->errnum = errnum;
+	pthread_cond_broadcast(&d->changed);
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+/* Read until we know whether it's compressed. */
+static bool sniff(struct input *in, const struct magic **magic)
+{
+	for (;;) {
+		bool possible = false;
+		ssize_t r;
+		size_t i;
+
+		for (i = 0; i < sizeof(magics) / sizeof(magics[0]); i++) {
+			const struct magic *m = &magics[i];
+			size_t len = in->peek_len < m->len
+				? in->peek_len : m->len;
+
+			if (memcmp(in->peek, m->bytes, len) != 0)
+				continue;
+			if (len == m->len) {
+				*magic = m;
+				return true;
+			}
+			possible = true;
+		}
+
+		if (!possible)
+			break;
+
+		do {
+			r = read(in->fd, in->peek + in->peek_len,
+				 sizeof(in->peek) - in->peek_len);
+		} while (r < 0 && errno == EINTR);
+		if (r < 0)
+			return false;
+		if (r == 0)
+			break;
+		in->peek_len += r;
+	}
+	*magic = NULL;
+	return true;
+}
+
+bool input_init(struct input *in, int fd, unsigned flags)
+{
+	const struct magic *magic;
+	struct decompressor *d;
+
+	in->fd = fd;
+	in->close_fd = false;
+	in->peek_off = in->peek_len = 0;
+	in->dec = NULL;
+	in->uring = NULL;
+
+	if (!sniff(in, &magic))
+		return false;
+
+	if (magic && !magic->supported) {
+		warnx("input is %s compressed, but built without %s support",
+		      magic->name, magic->name);
+		errno = ENOTSUP;
+		return false;
+	}
+
+	if (flags & INPUT_URING) {
+		in->uring = uring_new(fd);
+		if (!in->uring)
+			warn("Could not set up io_uring, using read()");
+	}
+
+	if (!magic)
+		return true;
+
+	d = malloc(sizeof(*d));
+	if (!d)
+		goto fail;
+	d->in = in;
+	d->magic = magic;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->changed, NULL);
+	d->produced = d->consumed = d->consumed_off = 0;
+	d->done = d->stop = false;
+	d->errnum = 0;
+	errno = pthread_create(&d->thread, NULL, decompress_thread, d);
+	if (errno) {
+		pthread_cond_destroy(&d->changed);
+		pthread_mutex_destroy(&d->lock);
+		free(d);
+		goto fail;
+	}
+	in->dec = d;
+	return true;
+
+fail:
+	if (in->uring) {
+		int saved_errno = errno;
+		uring_free(in->uring);
+		errno = saved_errno;
+	}
+	return false;
+}
+
+bool input_open(struct input *in, const char *name, unsigned flags)
+{
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+	if (!input_init(in, fd, flags)) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return false;
+	}
+	in->close_fd = true;
+	return true;
+}
+
+static ssize_t dec_read(struct decompressor *d, void *buf, size_t len)
+{
+	struct dec_block *b;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->consumed == d->produced && !d->done)
+		pthread_cond_wait(&d->changed, &d->lock);
+	if (d->consumed == d->produced) {
+		pthread_mutex_unlock(&d->lock);
+		errno = d->errnum;
+		return d->errnum ? -1 : 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	/* The thread won't touch this block until we're done with it. */
+	b = &d->block[d->consumed % DEC_BLOCKS];
+	if (len > b->len - d->consumed_off)
+		len = b->len - d->consumed_off;
+	memcpy(buf, b->data + d->consumed_off, len);
+	d->consumed_off += len;
+
+	if (d->consumed_off == b->len) {
+		pthread_mutex_lock(&d->lock);
+		d->consumed++;
+		d->consumed_off = 0;
+		pthread_cond_broadcast(&d->changed);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return len;
+}
+
+ssize_t input_read(struct input *in, void *buf, size_t len)
+{
+	if (in->dec)
+		return dec_read(in->dec, buf, len);
+	return raw_read(in, buf, len);
+}
+
+void input_close(struct input *in)
+{
+	struct decompressor *d = in->dec;
+
+	if (d) {
+		pthread_mutex_lock(&d->lock);
+		d->stop = true;
+		pthread_cond_broadcast(&d->changed);
+		pthread_mutex_unlock(&d->lock);
+		pthread_join(d->thread, NULL);
+		pthread_cond_destroy(&d->changed);
+		pthread_mutex_destroy(&d->lock);
+		free(d);
+		in->dec = NULL;
+	}
+	if (in->uring) {
+		uring_free(in->uring);
+		in->uring = NULL;
+	}
+	if (in->close_fd)
+		close(in->fd);
+}
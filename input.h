@@ -0,0 +1,72 @@
+/* Licensed under GPLv3 (or any later version) - see LICENSE file for details */
+#ifndef STATS_INPUT_H
+#define STATS_INPUT_H
+#include "config.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct decompressor;
+struct uring;
+
+/* Flag for input_open()/input_init(): read with io_uring, if we can. */
+#define INPUT_URING 1
+
+/*
+ * An input file or stream.  If it starts with the magic bytes of a
+ * compressed format we understand, it's decompressed by a separate
+ * thread, and input_read() hands out the decompressed data.
+ */
+struct input {
+	int fd;
+	bool close_fd;
+
+	/* What we read while checking the format: returned first. */
+	unsigned char peek[8];
+	size_t peek_off, peek_len;
+
+	/* Non-NULL if we're decompressing. */
+	struct decompressor *dec;
+
+	/* Non-NULL if we're reading using io_uring. */
+	struct uring *uring;
+};
+
+/**
+ * input_open - open a file for input.
+ * @in: the struct input.
+ * @name: the filename.
+ * @flags: INPUT_URING, or 0.
+ *
+ * Returns false (with errno set) if the open fails, or the file is
+ * compressed in a format we weren't built to handle (ENOTSUP).  If
+ * io_uring is requested but unavailable, we warn and use read().
+ */
+bool input_open(struct input *in, const char *name, unsigned flags);
+
+/**
+ * input_init - set up input from an already-open fd.
+ * @in: the struct input.
+ * @fd: the file descriptor (not closed by input_close()).
+ * @flags: INPUT_URING, or 0.
+ *
+ * Returns false (with errno set) on failure, like input_open().
+ */
+bool input_init(struct input *in, int fd, unsigned flags);
+
+/**
+ * input_read - read() from an input.
+ * @in: the struct input.
+ * @buf: the buffer to fill.
+ * @len: the maximum to read.
+ *
+ * Returns the number of bytes read, 0 at the end, or -1 with errno set.
+ */
+ssize_t input_read(struct input *in, void *buf, size_t len);
+
+/**
+ * input_close - stop reading an input and free its resources.
+ * @in: the struct input.
+ */
+void input_close(struct input *in);
+
+#endif /* STATS_INPUT_H */
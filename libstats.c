@@ -0,0 +1,4947 @@
+/* Licensed under GPLv3 (or any later version) - see LICENSE file for details */
+#include <ccan/err/err.h>
+#include <ccan/rbuf/rbuf.h>
+#include <ccan/htable/htable_type.h>
+#include <ccan/htable/swisstable.h>
+#include <ccan/hash/hash.h>
+#include <ccan/list/list.h>
+#include <ccan/str/str.h>
+#include <ccan/tally/tally.h>
+#include "input.h"
+#include "stats.h"
+#include <unistd.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/resource.h>
+#if HAVE_PERF_EVENT
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/mman.h>
+#include <limits.h>
+#include <float.h>
+#include <errno.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+/* For --profile's heap bytes: glibc only. */
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+#define HAVE_MALLINFO2 1
+#endif
+#endif
+#ifndef HAVE_MALLINFO2
+#define HAVE_MALLINFO2 0
+#endif
+
+enum pattern_type {
+	LITERAL,
+	INTEGER,
+	FLOAT,
+	/* These are parsing states. */
+	PRESPACES,
+	TERM
+};
+
+union val {
+	long long ival;
+	double dval;
+};
+
+/* Numbers with units (see --numbers=units) are kept in these. */
+enum unit {
+	UNIT_NONE,
+	UNIT_TIME,
+	UNIT_BYTES
+};
+
+struct pattern_part {
+	enum pattern_type type;
+	/* Part of the pattern: "5ms" doesn't match "5MB", or "5". */
+	unsigned char unit;
+	/* While printing, what a number find_literal_numbers() made LITERAL
+	 * was before. */
+	unsigned char number_type;
+	/* With --fields, a number we don't analyze: it's LITERAL, but
+	 * matches any number. */
+	unsigned char wild;
+	/* With --key-field, the number lines are grouped by: it's LITERAL,
+	 * but kept a part of its own (see group_keyed_lines()). */
+	unsigned char key;
+	size_t off, len;
+};
+
+struct pattern {
+	const char *text;
+	size_t num_parts;
+	struct pattern_part part[ /* num_parts */ ];
+};
+
+/*
+ * Each numeric field of a line keeps its values in a column: a list of
+ * blocks, which grow geometrically so rare lines stay small.  A block
+ * remembers the type it was written as, so promoting a field from
+ * INTEGER to FLOAT doesn't have to touch it.
+ */
+#define BLOCK_MIN_VALS 4
+#define BLOCK_MAX_VALS 4096
+
+struct block {
+	struct list_node list;
+	enum pattern_type type;
+	size_t num, max;
+	/* Raw values, or NULL once packed. */
+	union val *vals;
+	/* Packed values: packed_len bytes here, or (if NULL) at spill_off. */
+	unsigned char *packed;
+	size_t packed_len;
+	off_t spill_off;
+};
+
+struct column {
+	struct list_head blocks;
+};
+
+/* Running totals for one part, so --sample still gets them exactly. */
+struct accum {
+	union val min, max, tot;
+};
+
+/*
+ * With --sample, a line keeps a uniform sample of rows (reservoir
+ * sampling), which go into its columns just before printing.
+ */
+struct sample {
+	/* Up to max rows of num_parts values each. */
+	union val *rows;
+	size_t num, size, max;
+	/* Algorithm L: the count of the next row to take, and its weight. */
+	long long next;
+	double w;
+	uint64_t rng;
+	/* One per part (unused for literals). */
+	struct accum *acc;
+};
+
+struct line {
+	struct list_node list;
+	struct pattern *pattern;
+	long long count;
+	/* With --max-patterns, the count of the line this replaced. */
+	long long error;
+
+	/* One per part (unused for literals). */
+	struct column *cols;
+	/* Non-NULL with --sample. */
+	struct sample *sample;
+	/* The line which followed this one last time (see add_line()). */
+	struct line *succ;
+	/* Can match_pattern() be used on this line's pattern? */
+	bool predictable;
+	/* While printing, one column per --derive (NULL if it lacks its
+	 * fields). */
+	struct column **derived;
+	/* While printing with --correlate (NULL if it has < 2 fields). */
+	struct correlation *corr;
+};
+
+static const struct pattern *line_key(const struct line *line)
+{
+	return line->pattern;
+}
+
+static size_t pattern_hash(const struct pattern *p)
+{
+	size_t i;
+	size_t h = p->num_parts;
+
+	for (i = 0; i < p->num_parts; i++) {
+		const struct pattern_part *part = &p->part[i];
+
+		if (part->type == LITERAL) {
+			if (!part->wild)
+				h = hash(p->text + part->off, part->len, h);
+		} else if (part->unit)
+			h = hash(&part->unit, 1, h);
+	}
+	return h;
+}
+
+/* Unless @any_key, the --key-field values have to match, too. */
+static inline bool parts_eq(const struct pattern *p,
+			    const struct pattern *p2, bool any_key)
+{
+	size_t i;
+
+	if (p->num_parts != p2->num_parts)
+		return false;
+	for (i = 0; i < p->num_parts; i++) {
+		const struct pattern_part *part1 = &p->part[i];
+		const struct pattern_part *part2 = &p2->part[i];
+
+		if (part1->type == LITERAL) {
+			if (part2->type != LITERAL || part1->wild != part2->wild
+			    || part1->key != part2->key)
+				return false;
+			if (part1->wild || (part1->key && any_key))
+				continue;
+			if (part1->len != part2->len)
+				return false;
+			if (strncmp(p->text + part1->off,
+				    p2->text + part2->off,
+				    part1->len))
+				return false;
+		} else if (part2->type == LITERAL || part1->unit != part2->unit)
+			return false;
+	}
+	return true;
+}
+
+static bool line_eq(const struct line *line, const struct pattern *p)
+{
+	return parts_eq(p, line->pattern, false);
+}
+
+#if HAVE_SWISSTABLE
+SWISSTABLE_DEFINE_TYPE(struct line, line_key, pattern_hash, line_eq, linehash);
+#else
+HTABLE_DEFINE_TYPE(struct line, line_key, pattern_hash, line_eq, linehash);
+#endif
+
+/*
+ * The pattern table is split by hash, so tokenizer threads can look up
+ * and insert patterns concurrently, each holding only one shard's lock.
+ */
+#define LINE_SHARD_BITS 6
+#define LINE_SHARDS (1 << LINE_SHARD_BITS)
+
+struct line_shard {
+	pthread_mutex_t lock;
+	struct linehash patterns;
+};
+
+/* A line, and its count + error when it was last put in the heap. */
+struct heap_entry {
+	long long weight;
+	struct line *line;
+};
+
+struct needle {
+	const char *str;
+	size_t len;
+};
+
+/*
+ * A set of --match or --exclude strings.  A few are each searched for
+ * with contains(); with more, find_needle() makes one pass over the
+ * line, looking up each byte in by_first[], so the cost hardly grows
+ * with the number of strings.
+ */
+struct needles {
+	size_t num;
+	/* Sorted by first byte: n[by_first[c]] up to n[by_first[c+1]]
+	 * start with c. */
+	struct needle *n;
+	size_t by_first[257];
+	/* One is "", which every line contains. */
+	bool empty;
+};
+
+/* Up to this many, searching for each is quicker. */
+#define FEW_NEEDLES 4
+
+struct file {
+	/* In order of first appearance in the input (with --key-field,
+	 * grouped when printing: see group_keyed_lines()). */
+	struct list_head lines;
+	struct line_shard shard[LINE_SHARDS];
+
+	/* Settings: --numbers= forms, --sample and --max-patterns. */
+	unsigned number_forms;
+	size_t sample_max, max_patterns;
+	/* With --fields, which numbers (from 0) to analyze; else NULL. */
+	bool *fields;
+	size_t num_fields;
+	/* With --key-field, which number (from 1) to group lines by. */
+	size_t key_field;
+	/* --match and --exclude strings (see filter_line()). */
+	struct needles match, exclude;
+	/* --derive expressions, compiled. */
+	struct derive *derive;
+	size_t num_derive;
+
+	/* With --max-patterns, a min-heap of the lines (see heap_min()). */
+	struct heap_entry *heap;
+	size_t heap_num, heap_max;
+	/* How many input lines were in lines we threw away. */
+	long long other_count;
+
+	/* The line we added last, to predict the next. */
+	struct line *last;
+	/* Where match_pattern() puts what it parses. */
+	union val *match_vals;
+	enum pattern_type *match_types;
+	size_t match_max;
+};
+
+/*
+ * A --derive expression, such as "rate=[1]/[2]", is compiled to a
+ * stack program.  Rather than running it for each row, each op runs
+ * over a chunk of rows at once (see derive_line()), so evaluating it
+ * is a few tight loops over arrays, which the compiler can vectorize.
+ */
+enum derive_opcode {
+	DERIVE_FIELD,
+	DERIVE_CONST,
+	DERIVE_ADD,
+	DERIVE_SUB,
+	DERIVE_MUL,
+	DERIVE_DIV,
+	DERIVE_NEG
+};
+
+struct derive_op {
+	enum derive_opcode op;
+	/* The field (from 1) for DERIVE_FIELD, or DERIVE_CONST's value. */
+	size_t field;
+	double val;
+};
+
+struct derive {
+	char *name;
+	struct derive_op *ops;
+	size_t num_ops;
+	/* The most values on the stack at once. */
+	size_t depth;
+};
+
+struct derive_parse {
+	const char *s;
+	struct derive *d;
+	size_t depth;
+	const char *error;
+};
+
+static void derive_emit(struct derive_parse *dp, enum derive_opcode op,
+			size_t field, double val)
+{
+	struct derive *d = dp->d;
+
+	d->ops = realloc(d->ops, sizeof(*d->ops) * (d->num_ops + 1));
+	d->ops[d->num_ops].op = op;
+	d->ops[d->num_ops].field = field;
+	d->ops[d->num_ops].val = val;
+	d->num_ops++;
+	/* Binary operators take two values and leave one. */
+	if (op == DERIVE_FIELD || op == DERIVE_CONST) {
+		if (++dp->depth > d->depth)
+			d->depth = dp->depth;
+	} else if (op != DERIVE_NEG)
+		dp->depth--;
+}
+
+static char derive_next(struct derive_parse *dp)
+{
+	while (cisspace(*dp->s))
+		dp->s++;
+	return *dp->s;
+}
+
+static void derive_sum(struct derive_parse *dp);
+
+/* A [field], a number, a (sum), or a negated one of those. */
+static void derive_unary(struct derive_parse *dp)
+{
+	char *end;
+
+	switch (derive_next(dp)) {
+	case '-':
+		dp->s++;
+		derive_unary(dp);
+		derive_emit(dp, DERIVE_NEG, 0, 0);
+		return;
+	case '(':
+		dp->s++;
+		derive_sum(dp);
+		if (dp->error)
+			return;
+		if (derive_next(dp) != ')') {
+			dp->error = "missing )";
+			return;
+		}
+		dp->s++;
+		return;
+	case '[':
+		if (!cisdigit(dp->s[1])) {
+			dp->error = "expected a field number after [";
+			return;
+		}
+		derive_emit(dp, DERIVE_FIELD, strtoul(dp->s + 1, &end, 10), 0);
+		if (*end != ']' || dp->d->ops[dp->d->num_ops - 1].field == 0) {
+			dp->error = "fields are [1], [2] and so on";
+			return;
+		}
+		dp->s = end + 1;
+		return;
+	}
+	derive_emit(dp, DERIVE_CONST, 0, strtod(dp->s, &end));
+	if (end == dp->s)
+		dp->error = "expected [field], a number or (";
+	dp->s = end;
+}
+
+static void derive_product(struct derive_parse *dp)
+{
+	char c;
+
+	derive_unary(dp);
+	while (!dp->error && ((c = derive_next(dp)) == '*' || c == '/')) {
+		dp->s++;
+		derive_unary(dp);
+		derive_emit(dp, c == '*' ? DERIVE_MUL : DERIVE_DIV, 0, 0);
+	}
+}
+
+static void derive_sum(struct derive_parse *dp)
+{
+	char c;
+
+	derive_product(dp);
+	while (!dp->error && ((c = derive_next(dp)) == '+' || c == '-')) {
+		dp->s++;
+		derive_product(dp);
+		derive_emit(dp, c == '+' ? DERIVE_ADD : DERIVE_SUB, 0, 0);
+	}
+}
+
+/* Returns NULL, or what's wrong with @def (and @d is left empty). */
+static const char *derive_compile(struct derive *d, const char *def)
+{
+	const char *eq = strchr(def, '='), *end = eq;
+	struct derive_parse dp;
+
+	d->name = NULL;
+	d->ops = NULL;
+	d->num_ops = d->depth = 0;
+	if (!eq)
+		return "expected NAME=EXPRESSION";
+	while (cisspace(*def))
+		def++;
+	while (end > def && cisspace(end[-1]))
+		end--;
+	if (end == def)
+		return "expected NAME=EXPRESSION";
+	dp.s = eq + 1;
+	dp.d = d;
+	dp.depth = 0;
+	dp.error = NULL;
+	derive_sum(&dp);
+	if (!dp.error && derive_next(&dp))
+		dp.error = "unexpected text after expression";
+	if (dp.error) {
+		free(d->ops);
+		d->ops = NULL;
+		d->num_ops = 0;
+		return dp.error;
+	}
+	d->name = strndup(def, end - def);
+	return NULL;
+}
+
+static void needles_init(struct needles *ns, const char *const *strs,
+			 size_t num)
+{
+	size_t i, c;
+
+	ns->num = num;
+	ns->n = malloc(sizeof(*ns->n) * num);
+	ns->empty = false;
+	memset(ns->by_first, 0, sizeof(ns->by_first));
+	/* Count each first byte, then place them (a counting sort). */
+	for (i = 0; i < num; i++) {
+		if (strs[i][0])
+			ns->by_first[(unsigned char)strs[i][0] + 1]++;
+		else
+			ns->empty = true;
+	}
+	for (c = 1; c < 257; c++)
+		ns->by_first[c] += ns->by_first[c - 1];
+	for (i = 0; i < num; i++) {
+		struct needle *n;
+
+		if (!strs[i][0])
+			continue;
+		n = &ns->n[ns->by_first[(unsigned char)strs[i][0]]++];
+		n->str = strs[i];
+		n->len = strlen(strs[i]);
+	}
+	/* Placing them moved each start up to the next one's. */
+	memmove(ns->by_first + 1, ns->by_first, sizeof(ns->by_first[0]) * 256);
+	ns->by_first[0] = 0;
+}
+
+static void file_init(struct file *info, const struct stats_config *config)
+{
+	size_t i;
+
+	list_head_init(&info->lines);
+	info->number_forms = config->numbers;
+	info->sample_max = config->sample;
+	info->max_patterns = config->max_patterns;
+	info->fields = NULL;
+	info->num_fields = 0;
+	info->key_field = config->key_field;
+	for (i = 0; i < config->num_fields; i++)
+		if (config->fields[i] > info->num_fields)
+			info->num_fields = config->fields[i];
+	if (config->num_fields) {
+		info->fields = calloc(info->num_fields, sizeof(bool));
+		for (i = 0; i < config->num_fields; i++)
+			info->fields[config->fields[i] - 1] = true;
+	}
+	needles_init(&info->match, config->match, config->num_match);
+	needles_init(&info->exclude, config->exclude, config->num_exclude);
+	info->derive = malloc(sizeof(*info->derive) * config->num_derive);
+	for (i = info->num_derive = 0; i < config->num_derive; i++)
+		if (!stats_check_derive(config->derive[i], i, config->derive))
+			derive_compile(&info->derive[info->num_derive++],
+				       config->derive[i]);
+	info->heap = NULL;
+	info->heap_num = info->heap_max = 0;
+	info->other_count = 0;
+	info->last = NULL;
+	info->match_vals = NULL;
+	info->match_types = NULL;
+	info->match_max = 0;
+	for (i = 0; i < LINE_SHARDS; i++) {
+		pthread_mutex_init(&info->shard[i].lock, NULL);
+		linehash_init(&info->shard[i].patterns);
+	}
+}
+
+/* Do we keep the values of the @n'th number (from 0) of each line? */
+static bool field_wanted(const struct file *info, size_t n)
+{
+	return !info->fields || (n < info->num_fields && info->fields[n]);
+}
+
+/*
+ * Is @n in @line?  With SSE2, we compare 16 positions at once against
+ * its first and last bytes, and only memcmp() where both match.
+ */
+static bool contains(const char *line, size_t len, const struct needle *n)
+{
+	size_t i = 0;
+
+	if (n->len > len)
+		return false;
+#ifdef __SSE2__
+	if (n->len) {
+		__m128i first = _mm_set1_epi8(n->str[0]);
+		__m128i last = _mm_set1_epi8(n->str[n->len - 1]);
+
+		for (; i + n->len - 1 + 16 <= len; i += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(line + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)
+						    (line + i + n->len - 1));
+			unsigned int mask;
+
+			mask = _mm_movemask_epi8(_mm_and_si128(
+					_mm_cmpeq_epi8(a, first),
+					_mm_cmpeq_epi8(b, last)));
+			while (mask) {
+				size_t at = i + __builtin_ffs(mask) - 1;
+
+				if (memcmp(line + at, n->str, n->len) == 0)
+					return true;
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+	return memmem(line + i, len - i, n->str, n->len) != NULL;
+}
+
+/* Does @line contain any of @ns? */
+static bool find_needle(const char *line, size_t len,
+			const struct needles *ns)
+{
+	size_t i, j;
+
+	if (ns->empty)
+		return true;
+	if (ns->num <= FEW_NEEDLES) {
+		for (i = 0; i < ns->num; i++)
+			if (contains(line, len, &ns->n[i]))
+				return true;
+		return false;
+	}
+	for (i = 0; i < len; i++) {
+		unsigned char c = line[i];
+
+		for (j = ns->by_first[c]; j < ns->by_first[c + 1]; j++) {
+			const struct needle *n = &ns->n[j];
+
+			if (n->len <= len - i
+			    && memcmp(line + i, n->str, n->len) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+/* Does @line have any --match string (if given), and no --exclude one? */
+static bool filter_line(const struct file *info, const char *line, size_t len)
+{
+	if (info->match.num && !find_needle(line, len, &info->match))
+		return false;
+	return !info->exclude.num || !find_needle(line, len, &info->exclude);
+}
+
+static bool filtering(const struct file *info)
+{
+	return info->match.num || info->exclude.num;
+}
+
+static struct line_shard *line_shard(struct file *info, size_t h)
+{
+	/* The table uses the low bits of the (32-bit) hash: use the top. */
+	return &info->shard[(uint32_t)h >> (32 - LINE_SHARD_BITS)];
+}
+
+static inline size_t partsize(size_t num)
+{
+	return sizeof(struct pattern) + sizeof(struct pattern_part) * num;
+}
+
+static inline size_t valsize(size_t num)
+{
+	return sizeof(union val) * num;
+}
+
+static void add_part(struct pattern **p, union val **vals,
+		     const struct pattern_part *part, const union val *v,
+		     size_t *max_parts)
+{
+	if ((*p)->num_parts == *max_parts) {
+		*max_parts *= 2;
+		*p = realloc(*p, partsize(*max_parts));
+		*vals = realloc(*vals, valsize(*max_parts));
+	}
+	(*vals)[(*p)->num_parts] = *v;
+	(*p)->part[(*p)->num_parts++] = *part;
+}
+
+/* Values with units are scaled to the first unit here. */
+static const char *unit_names[] = { "", "ns", "B" };
+
+static const struct unit_suffix {
+	const char *suffix;
+	enum unit unit;
+	long long scale;
+} unit_suffixes[] = {
+	{ "ns", UNIT_TIME, 1 },
+	{ "us", UNIT_TIME, 1000 },
+	{ "\xc2\xb5s", UNIT_TIME, 1000 },
+	{ "ms", UNIT_TIME, 1000000 },
+	{ "s", UNIT_TIME, 1000000000 },
+	{ "B", UNIT_BYTES, 1 },
+	{ "kB", UNIT_BYTES, 1000LL },
+	{ "KB", UNIT_BYTES, 1000LL },
+	{ "MB", UNIT_BYTES, 1000LL * 1000 },
+	{ "GB", UNIT_BYTES, 1000LL * 1000 * 1000 },
+	{ "TB", UNIT_BYTES, 1000LL * 1000 * 1000 * 1000 },
+	{ "KiB", UNIT_BYTES, 1LL << 10 },
+	{ "MiB", UNIT_BYTES, 1LL << 20 },
+	{ "GiB", UNIT_BYTES, 1LL << 30 },
+	{ "TiB", UNIT_BYTES, 1LL << 40 },
+};
+#define NUM_UNIT_SUFFIXES (sizeof(unit_suffixes) / sizeof(unit_suffixes[0]))
+
+/* Can a number end here, or does it run into more text? */
+static bool number_end(const char *s, unsigned forms)
+{
+	if (cisalnum(*s) || *s == '_')
+		return false;
+	if (*s == '.' && cisdigit(s[1]))
+		return false;
+	if ((forms & STATS_NUMBERS_THOUSANDS) && *s == ',' && cisdigit(s[1]))
+		return false;
+	return true;
+}
+
+static bool three_digits(const char *s)
+{
+	return cisdigit(s[0]) && cisdigit(s[1]) && cisdigit(s[2])
+		&& !cisdigit(s[3]);
+}
+
+/*
+ * get_pattern() calls this where a decimal number (from @num, perhaps
+ * after spaces) runs into non-space @s.  If it's one of the --numbers=
+ * forms, return its type and value, and where it ends.  Otherwise NULL,
+ * and it's a literal as usual.
+ */
+static const char *extend_number(const char *num, const char *s,
+				 unsigned forms, enum pattern_type *typep, union val *vp,
+				 unsigned char *unitp)
+{
+	const char *end = s, *p;
+	char buf[64], *b = buf;
+	enum pattern_type type;
+	enum unit unit = UNIT_NONE;
+	union val v;
+	unsigned long long u;
+	size_t i;
+
+	while (cisspace(*num))
+		num++;
+	type = memchr(num, '.', s - num) ? FLOAT : INTEGER;
+
+	if ((forms & STATS_NUMBERS_HEX)
+	    && s - num == 1 && num[0] == '0'
+	    && (*s == 'x' || *s == 'X') && cisxdigit(s[1])) {
+		for (end = s + 1; cisxdigit(*end); end++);
+		if (!number_end(end, forms))
+			return NULL;
+		/* Too big for a long long (eg. an address): use a double. */
+		errno = 0;
+		u = strtoull(num, NULL, 16);
+		if (u > LLONG_MAX || errno == ERANGE) {
+			*typep = FLOAT;
+			vp->dval = u;
+		} else {
+			*typep = INTEGER;
+			vp->ival = u;
+		}
+		*unitp = UNIT_NONE;
+		return end;
+	}
+
+	if ((forms & STATS_NUMBERS_THOUSANDS) && type == INTEGER
+	    && s - num - (*num == '-') <= 3 && *s == ',') {
+		while (*end == ',' && three_digits(end + 1))
+			end += 4;
+		if (*end == '.' && cisdigit(end[1])) {
+			for (end++; cisdigit(*end); end++);
+			type = FLOAT;
+		}
+	}
+
+	if ((forms & STATS_NUMBERS_EXP) && (*end == 'e' || *end == 'E')) {
+		p = end + 1;
+		if (*p == '-' || *p == '+')
+			p++;
+		if (cisdigit(*p)) {
+			for (end = p; cisdigit(*end); end++);
+			type = FLOAT;
+		}
+	}
+
+	/* Copy it without the separators, to parse. */
+	if (end - num >= sizeof(buf))
+		return NULL;
+	for (p = num; p < end; p++)
+		if (*p != ',')
+			*(b++) = *p;
+	*b = '\0';
+	if (type == FLOAT)
+		v.dval = strtod(buf, NULL);
+	else
+		v.ival = strtoll(buf, NULL, 10);
+
+	if ((forms & STATS_NUMBERS_UNITS) && !number_end(end, forms)) {
+		for (i = 0; i < NUM_UNIT_SUFFIXES; i++) {
+			const struct unit_suffix *u = &unit_suffixes[i];
+			size_t len = strlen(u->suffix);
+
+			if (strncmp(end, u->suffix, len) == 0
+			    && number_end(end + len, forms))
+				break;
+		}
+		if (i == NUM_UNIT_SUFFIXES)
+			return NULL;
+		end += strlen(unit_suffixes[i].suffix);
+		unit = unit_suffixes[i].unit;
+		if (type == FLOAT)
+			v.dval *= unit_suffixes[i].scale;
+		else if (llabs(v.ival) > LLONG_MAX / unit_suffixes[i].scale) {
+			v.dval = (double)v.ival * unit_suffixes[i].scale;
+			type = FLOAT;
+		} else
+			v.ival *= unit_suffixes[i].scale;
+	}
+
+	if (end == s || !number_end(end, forms))
+		return NULL;
+	*typep = type;
+	*vp = v;
+	*unitp = unit;
+	return end;
+}
+
+/*
+ * We want "finished in100 seconds" to match "finished in  5 seconds".
+ * Numbers --fields doesn't want are only found, not parsed.  The
+ * --key-field number is literal, like those --skip skips, so each
+ * value of it is a line (a group) of its own.
+ */
+static struct pattern *get_pattern(const char *line, unsigned skip,
+				   const struct file *info, union val **vals)
+{
+	enum pattern_type state = LITERAL, ext_type;
+	unsigned forms = info->number_forms;
+	size_t len, i, max_parts = 3, number = 0;
+	struct pattern_part part;
+	struct pattern *p;
+	/* Set once extend_number() has recognized the current number. */
+	bool have_ext = false;
+	union val ext_val;
+	unsigned char ext_unit;
+
+	*vals = malloc(valsize(max_parts));
+	p = malloc(partsize(max_parts));
+	p->text = line;
+	p->num_parts = 0;
+
+	for (i = len = 0; state != TERM; i++, len++) {
+		enum pattern_type old_state = state;
+		bool starts_num;
+		union val v;
+		const char *ext_end;
+
+		starts_num = (line[i] == '-' && cisdigit(line[i+1]))
+			|| cisdigit(line[i]);
+
+		switch (state) {
+		case LITERAL:
+			if (starts_num) {
+				state = INTEGER;
+				break;
+			} else if (cisspace(line[i])) {
+				state = PRESPACES;
+				break;
+			}
+			break;
+		case PRESPACES:
+			if (starts_num) {
+				state = INTEGER;
+				break;
+			} else if (!cisspace(line[i])) {
+				state = LITERAL;
+			}
+			break;
+		case INTEGER:
+			if (line[i] == '.') {
+				if (cisdigit(line[i+1])) {
+					/* Was float all along... */
+					state = old_state = FLOAT;
+				} else
+					state = LITERAL;
+				break;
+			}
+			/* fall thru */
+		case FLOAT:
+			if (cisspace(line[i])) {
+				state = PRESPACES;
+				break;
+			} else if (!cisdigit(line[i])) {
+				/* Only looked at when a number runs into text. */
+				if (forms && !have_ext
+				    && (ext_end = extend_number(line + i - len,
+								line + i, forms,
+								&ext_type,
+								&ext_val,
+								&ext_unit))) {
+					/* Resume at its end, as a number. */
+					have_ext = true;
+					len += ext_end - (line + i) - 1;
+					i = ext_end - line - 1;
+					state = old_state = ext_type;
+					break;
+				}
+				state = LITERAL;
+				break;
+			}
+			break;
+		case TERM:
+			abort();
+		}
+
+		if (!line[i])
+			state = TERM;
+
+		if (state == old_state)
+			continue;
+
+		part.type = old_state;
+		part.unit = UNIT_NONE;
+		part.number_type = LITERAL;
+		part.wild = 0;
+		part.key = 0;
+		part.len = len;
+		part.off = i - len;
+		/* Make sure identical values memcmp in find_literal_numbers  */
+		memset(&v, 0, sizeof(v));
+
+		if (old_state == FLOAT || old_state == INTEGER) {
+			if (skip) {
+				part.type = old_state = LITERAL;
+				skip--;
+			} else if (++number == info->key_field) {
+				part.type = old_state = LITERAL;
+				part.key = 1;
+			} else if (!field_wanted(info, number - 1)) {
+				part.type = LITERAL;
+				part.wild = 1;
+				have_ext = false;
+				add_part(&p, vals, &part, &v, &max_parts);
+				len = 0;
+				continue;
+			}
+		}
+
+		if (have_ext) {
+			have_ext = false;
+			if (old_state != LITERAL) {
+				v = ext_val;
+				part.unit = ext_unit;
+				add_part(&p, vals, &part, &v, &max_parts);
+				len = 0;
+				continue;
+			}
+		}
+
+		if (old_state == FLOAT) {
+			char *end;
+			v.dval = strtod(line + part.off, &end);
+			if (end != line + i) {
+				warnx("Could not parse float '%.*s'",
+				      (int)len, line + i - len);
+			} else {
+				add_part(&p, vals, &part, &v, &max_parts);
+			}
+			len = 0;
+		} else if (old_state == INTEGER) {
+			char *end;
+			v.ival = strtoll(line + part.off, &end, 10);
+			if (end != line + i) {
+				warnx("Could not parse integer '%.*s'",
+				      (int)len, line + i - len);
+			} else {
+				add_part(&p, vals, &part, &v, &max_parts);
+			}
+			len = 0;
+		} else if (old_state == LITERAL && len > 0) {
+			/* Since we can go to PRESPACES and back, we can
+			 * have successive literals.  Collapse them. */
+			if (p->num_parts > 0 && !part.key
+			    && p->part[p->num_parts-1].type == LITERAL
+			    && !p->part[p->num_parts-1].wild
+			    && !p->part[p->num_parts-1].key) {
+				p->part[p->num_parts-1].len += len;
+				len = 0;
+				continue;
+			}
+			add_part(&p, vals, &part, &v, &max_parts);
+			len = 0;
+		}
+	}
+	return p;
+}
+
+static void val_to_float(union val *val)
+{
+	val->dval = val->ival;
+}
+
+/*
+ * With --profile, we time each phase and count what it did.  The
+ * ingest phases are per line, and reading the clock for each would
+ * about double the run time: instead we time runs of PROF_BURST calls,
+ * one in every PROF_SAMPLE, and scale that up.  Being so few, we can
+ * afford the thread CPU clock, which (unlike the wall clock) doesn't
+ * count time we were waiting or descheduled.  They're summed over
+ * every thread, like ingest's process CPU time, but the bursts we time
+ * start colder than the average call: so they're printed as estimates,
+ * scaled down if need be to add up to no more than ingest took.
+ * When it's off, all this costs is the test of prof.enabled.
+ */
+#define PROF_SAMPLE 64
+#define PROF_BURST 16
+
+enum phase {
+	/* Reading and splitting input, all of it. */
+	PHASE_INGEST,
+	PHASE_READ,
+	PHASE_TOKENIZE,
+	PHASE_LOOKUP,
+	PHASE_ADD,
+	/* Merging inputs (with --aggregate). */
+	PHASE_MERGE,
+	/* find_literal_numbers(), then printing. */
+	PHASE_LITERALS,
+	PHASE_DERIVE,
+	PHASE_CORRELATE,
+	PHASE_PRINT,
+	NUM_PHASES
+};
+
+static const char *phase_names[NUM_PHASES] = {
+	"ingest", "  read", "  tokenize", "  lookup", "  add",
+	"merge", "literals", "derive", "correlate", "print"
+};
+
+enum counter {
+	COUNT_LINES,
+	COUNT_BYTES,
+	COUNT_BUF_COPIED,
+	COUNT_BUF_GROWS,
+	COUNT_PREDICTED,
+	COUNT_LOOKUPS,
+	COUNT_COMPARES,
+	COUNT_PATTERNS,
+	COUNT_EVICTIONS,
+	COUNT_PROMOTIONS,
+	COUNT_BLOCKS,
+	COUNT_FILTERED,
+	NUM_COUNTERS
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+	"lines", "bytes read", "read bytes copied", "read buffer grows",
+	"lines predicted", "pattern lookups", "pattern compares",
+	"patterns created", "patterns evicted", "int to float promotions",
+	"column blocks allocated", "filtered out"
+};
+
+/*
+ * With --perf-counters, the phases which aren't per-line also count
+ * hardware events, using perf_event_open(2).  Each is opened on its
+ * own, so we get whichever ones the CPU, kernel or container allows,
+ * and is inherited by the threads we start: those are joined by the
+ * end of the phase, which is when their counts are added in.
+ */
+enum hw_event {
+	HW_CYCLES,
+	HW_INSTRUCTIONS,
+	HW_BRANCH_MISSES,
+	HW_LLC_MISSES,
+	HW_DTLB_MISSES,
+	NUM_HW_EVENTS
+};
+
+static const char *hw_event_names[NUM_HW_EVENTS] = {
+	"cycles", "instructions", "branch-misses", "LLC-misses", "dTLB-misses"
+};
+
+static struct {
+	bool enabled;
+	uint64_t start, cpu_start;
+	/* What reading the thread CPU clock adds to what we time. */
+	uint64_t clock_cost;
+	/* Nanoseconds: wall[] is only for the phases which aren't per-line. */
+	uint64_t wall[NUM_PHASES], cpu[NUM_PHASES];
+	uint64_t count[NUM_COUNTERS];
+	/* The most we were holding when printing. */
+	size_t value_bytes, heap_bytes;
+
+	/* Hardware events: fd (or -1, and why not) for each. */
+	bool hw_enabled;
+	int hw_fd[NUM_HW_EVENTS], hw_errno[NUM_HW_EVENTS];
+	uint64_t hw[NUM_PHASES][NUM_HW_EVENTS];
+} prof;
+
+/* Which calls to time: per thread, so it needs no lock. */
+static __thread unsigned prof_tick;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void prof_count(enum counter c, uint64_t n)
+{
+	if (prof.enabled)
+		__atomic_fetch_add(&prof.count[c], n, __ATOMIC_RELAXED);
+}
+
+/* Returns the time to start a per-line phase at, or 0 to not time it. */
+static inline uint64_t prof_start(void)
+{
+	if (!prof.enabled)
+		return 0;
+	if (prof_tick++ % (PROF_SAMPLE * PROF_BURST) >= PROF_BURST)
+		return 0;
+	return clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static inline uint64_t prof_add(enum phase phase, uint64_t start,
+				unsigned scale)
+{
+	uint64_t now = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	if (now - start > prof.clock_cost)
+		__atomic_fetch_add(&prof.cpu[phase],
+				   (now - start - prof.clock_cost) * scale,
+				   __ATOMIC_RELAXED);
+	return now;
+}
+
+/* Adds the time since @start to @phase: returns the time, to start the next. */
+static inline uint64_t prof_next(enum phase phase, uint64_t start)
+{
+	return start ? prof_add(phase, start, PROF_SAMPLE) : 0;
+}
+
+/* For phases with too few calls to sample: time every one. */
+static inline uint64_t prof_start_all(void)
+{
+	return prof.enabled ? clock_ns(CLOCK_THREAD_CPUTIME_ID) : 0;
+}
+
+static inline void prof_next_all(enum phase phase, uint64_t start)
+{
+	if (start)
+		prof_add(phase, start, 1);
+}
+
+/* The phases which aren't per-line get (process) CPU time, too. */
+struct prof_span {
+	uint64_t wall, cpu;
+	uint64_t hw[NUM_HW_EVENTS];
+};
+
+/* Count so far, scaled up for any time the kernel had it switched out. */
+static uint64_t hw_read(enum hw_event e)
+{
+	uint64_t v[3];
+
+	if (prof.hw_fd[e] < 0
+	    || read(prof.hw_fd[e], v, sizeof(v)) != sizeof(v) || !v[2])
+		return 0;
+	return v[2] == v[1] ? v[0] : (double)v[0] * v[1] / v[2];
+}
+
+static void hw_open(void)
+{
+	size_t e;
+
+	for (e = 0; e < NUM_HW_EVENTS; e++) {
+#if HAVE_PERF_EVENT
+		static const struct {
+			uint32_t type;
+			uint64_t config;
+		} events[NUM_HW_EVENTS] = {
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+			{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+			  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+			{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+			  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+		};
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[e].type;
+		attr.config = events[e].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+			| PERF_FORMAT_TOTAL_TIME_RUNNING;
+		prof.hw_fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1,
+					-1, PERF_FLAG_FD_CLOEXEC);
+		prof.hw_errno[e] = prof.hw_fd[e] < 0 ? errno : 0;
+#else
+		prof.hw_fd[e] = -1;
+		prof.hw_errno[e] = ENOSYS;
+#endif
+	}
+}
+
+static inline void prof_begin(struct prof_span *span)
+{
+	size_t e;
+
+	if (prof.enabled) {
+		span->wall = clock_ns(CLOCK_MONOTONIC);
+		span->cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+		if (prof.hw_enabled)
+			for (e = 0; e < NUM_HW_EVENTS; e++)
+				span->hw[e] = hw_read(e);
+	}
+}
+
+static inline void prof_finish(enum phase phase, const struct prof_span *span)
+{
+	size_t e;
+
+	if (prof.enabled) {
+		__atomic_fetch_add(&prof.wall[phase],
+				   clock_ns(CLOCK_MONOTONIC) - span->wall,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&prof.cpu[phase],
+				   clock_ns(CLOCK_PROCESS_CPUTIME_ID)
+				   - span->cpu, __ATOMIC_RELAXED);
+		if (prof.hw_enabled)
+			for (e = 0; e < NUM_HW_EVENTS; e++)
+				__atomic_fetch_add(&prof.hw[phase][e],
+						   hw_read(e) - span->hw[e],
+						   __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Full blocks can be packed (see pack_ints() and pack_floats()), with
+ * --compress.  With --max-memory, once blocks use more than that, full
+ * blocks are packed into a temporary file as they're replaced, and
+ * read back as needed.  At the end of each input, whole lines are
+ * written out until we're back under the limit.
+ */
+static struct {
+	pthread_mutex_t lock;
+	/* Limit on (and current size of) blocks in memory; 0 is no limit. */
+	size_t max, used;
+	/* Temporary file for spilled blocks, and its length. */
+	int fd;
+	off_t end;
+	/* Pack blocks in memory, too? */
+	bool compress;
+} spill = { PTHREAD_MUTEX_INITIALIZER, 0, 0, -1, 0, false };
+
+/* The most bytes a value can take to pack. */
+#define MAX_PACKED 10
+
+static void spill_account(size_t add, size_t sub)
+{
+	pthread_mutex_lock(&spill.lock);
+	spill.used = spill.used + add - sub;
+	pthread_mutex_unlock(&spill.lock);
+}
+
+static bool over_budget(void)
+{
+	bool over;
+
+	pthread_mutex_lock(&spill.lock);
+	over = spill.max && spill.used > spill.max;
+	pthread_mutex_unlock(&spill.lock);
+	return over;
+}
+
+static size_t put_varint(unsigned char *p, uint64_t v)
+{
+	size_t len = 0;
+
+	while (v >= 0x80) {
+		p[len++] = v | 0x80;
+		v >>= 7;
+	}
+	p[len++] = v;
+	return len;
+}
+
+static uint64_t get_varint(const unsigned char **p)
+{
+	uint64_t v = 0;
+	unsigned shift = 0;
+
+	do {
+		v |= (uint64_t)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+	return v;
+}
+
+static uint64_t zigzag(uint64_t v)
+{
+	return (v << 1) ^ -(v >> 63);
+}
+
+static uint64_t unzigzag(uint64_t v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+/* Integers: delta-of-deltas, so a steady counter costs a byte each. */
+static size_t pack_ints(const union val *vals, size_t num, unsigned char *out)
+{
+	uint64_t prev = 0, delta = 0;
+	size_t i, len = 0;
+
+	for (i = 0; i < num; i++) {
+		uint64_t d = (uint64_t)vals[i].ival - prev;
+
+		len += put_varint(out + len, zigzag(d - delta));
+		delta = i ? d : 0;
+		prev = vals[i].ival;
+	}
+	return len;
+}
+
+static void unpack_ints(const unsigned char *in, size_t num, union val *vals)
+{
+	uint64_t prev = 0, delta = 0;
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		uint64_t d = delta + unzigzag(get_varint(&in));
+
+		prev += d;
+		delta = i ? d : 0;
+		vals[i].ival = prev;
+	}
+}
+
+/* Bit-at-a-time output and input, most significant bit first. */
+struct bitbuf {
+	unsigned char *p;
+	uint64_t acc;
+	unsigned num;
+};
+
+static void put_bits(struct bitbuf *b, uint64_t v, unsigned n)
+{
+	if (n > 32) {
+		put_bits(b, v >> 32, n - 32);
+		n = 32;
+	}
+	b->acc = (b->acc << n) | (v & ((1ULL << n) - 1));
+	b->num += n;
+	while (b->num >= 8) {
+		b->num -= 8;
+		*b->p++ = b->acc >> b->num;
+	}
+}
+
+static void flush_bits(struct bitbuf *b)
+{
+	if (b->num)
+		*b->p++ = b->acc << (8 - b->num);
+}
+
+static uint64_t get_bits(struct bitbuf *b, unsigned n)
+{
+	if (n > 32) {
+		uint64_t hi = get_bits(b, n - 32);
+		return (hi << 32) | get_bits(b, 32);
+	}
+	while (b->num < n) {
+		b->acc = (b->acc << 8) | *b->p++;
+		b->num += 8;
+	}
+	b->num -= n;
+	return (b->acc >> b->num) & ((1ULL << n) - 1);
+}
+
+/*
+ * Floats: XOR with the previous value, and keep only the meaningful
+ * bits, as Gorilla does.  '0' is a repeat, '10' is followed by bits in
+ * the same window as last time, '11' by 5 bits of leading zeros, 6
+ * bits of length-1, then the bits.
+ */
+static size_t pack_floats(const union val *vals, size_t num,
+			  unsigned char *out)
+{
+	struct bitbuf b = { out, 0, 0 };
+	uint64_t prev = 0;
+	unsigned lead = 0, len = 0;
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		uint64_t x = vals[i].ival ^ prev;
+		unsigned l, t;
+
+		prev = vals[i].ival;
+		if (!x) {
+			put_bits(&b, 0, 1);
+			continue;
+		}
+		l = __builtin_clzll(x);
+		if (l > 31)
+			l = 31;
+		t = __builtin_ctzll(x);
+		if (len && l >= lead && t >= 64 - lead - len) {
+			put_bits(&b, 2, 2);
+			put_bits(&b, x >> (64 - lead - len), len);
+		} else {
+			lead = l;
+			len = 64 - l - t;
+			put_bits(&b, 3, 2);
+			put_bits(&b, lead, 5);
+			put_bits(&b, len - 1, 6);
+			put_bits(&b, x >> t, len);
+		}
+	}
+	flush_bits(&b);
+	return b.p - out;
+}
+
+static void unpack_floats(const unsigned char *in, size_t num,
+			  union val *vals)
+{
+	struct bitbuf b = { (unsigned char *)in, 0, 0 };
+	uint64_t prev = 0;
+	unsigned lead = 0, len = 0;
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (get_bits(&b, 1)) {
+			if (get_bits(&b, 1)) {
+				lead = get_bits(&b, 5);
+				len = get_bits(&b, 6) + 1;
+			}
+			prev ^= get_bits(&b, len) << (64 - lead - len);
+		}
+		vals[i].ival = prev;
+	}
+}
+
+static void pack_block(struct block *b)
+{
+	unsigned char *buf = malloc(b->num * MAX_PACKED);
+
+	if (b->type == INTEGER)
+		b->packed_len = pack_ints(b->vals, b->num, buf);
+	else
+		b->packed_len = pack_floats(b->vals, b->num, buf);
+	b->packed = realloc(buf, b->packed_len);
+	free(b->vals);
+	b->vals = NULL;
+	spill_account(b->packed_len, b->max * sizeof(union val));
+}
+
+static void unpack_block(const struct block *b, const unsigned char *packed,
+			 union val *vals)
+{
+	if (b->type == INTEGER)
+		unpack_ints(packed, b->num, vals);
+	else
+		unpack_floats(packed, b->num, vals);
+}
+
+static void spill_block(struct block *b)
+{
+	off_t off;
+
+	if (b->vals)
+		pack_block(b);
+
+	pthread_mutex_lock(&spill.lock);
+	if (spill.fd < 0) {
+		FILE *f = tmpfile();
+		if (!f)
+			err(1, "Creating temporary file for --max-memory");
+		spill.fd = fileno(f);
+	}
+	off = spill.end;
+	spill.end += b->packed_len;
+	pthread_mutex_unlock(&spill.lock);
+
+	if (pwrite(spill.fd, b->packed, b->packed_len, off)
+	    != (ssize_t)b->packed_len)
+		err(1, "Writing temporary file for --max-memory");
+
+	free(b->packed);
+	spill_account(0, b->packed_len);
+	b->packed = NULL;
+	b->spill_off = off;
+}
+
+static struct column *new_columns(size_t num)
+{
+	struct column *cols = malloc(sizeof(*cols) * num);
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		list_head_init(&cols[i].blocks);
+	return cols;
+}
+
+static struct block *new_block(struct column *col, enum pattern_type type)
+{
+	struct block *prev = list_tail(&col->blocks, struct block, list);
+	struct block *b = malloc(sizeof(*b));
+
+	if (prev && prev->vals) {
+		if (spill.compress)
+			pack_block(prev);
+		/* Once we're over budget, each full block goes to disk. */
+		if (over_budget())
+			spill_block(prev);
+	}
+
+	prof_count(COUNT_BLOCKS, 1);
+	b->type = type;
+	b->num = 0;
+	b->max = prev ? prev->max * 2 : BLOCK_MIN_VALS;
+	if (b->max > BLOCK_MAX_VALS)
+		b->max = BLOCK_MAX_VALS;
+	b->vals = malloc(b->max * sizeof(union val));
+	b->packed = NULL;
+	spill_account(b->max * sizeof(union val), 0);
+	list_add_tail(&col->blocks, &b->list);
+	return b;
+}
+
+static void block_to_float(struct block *b)
+{
+	size_t i;
+
+	assert(b->type == INTEGER);
+	for (i = 0; i < b->num; i++)
+		val_to_float(&b->vals[i]);
+	b->type = FLOAT;
+}
+
+/* @type is the field's type, which @v must already be. */
+static void column_add(struct column *col, enum pattern_type type, union val v)
+{
+	struct block *b = list_tail(&col->blocks, struct block, list);
+
+	if (!b || !b->vals || b->num == b->max)
+		b = new_block(col, type);
+	else if (b->type != type)
+		block_to_float(b);
+	b->vals[b->num++] = v;
+}
+
+static void column_free(struct column *col)
+{
+	struct block *b;
+
+	while ((b = list_pop(&col->blocks, struct block, list)) != NULL) {
+		if (b->vals) {
+			free(b->vals);
+			spill_account(0, b->max * sizeof(union val));
+		} else if (b->packed) {
+			free(b->packed);
+			spill_account(0, b->packed_len);
+		}
+		free(b);
+	}
+}
+
+/* Reads a column back, a block at a time, as the field's current type. */
+struct col_iter {
+	const struct column *col;
+	enum pattern_type type;
+	const struct block *next;
+	/* Where we decode or convert blocks we can't hand out directly. */
+	union val *buf;
+	unsigned char *raw;
+	/* For col_iter_val(): the current block. */
+	const union val *vals;
+	size_t i, num;
+};
+
+static void col_iter_init(struct col_iter *it, const struct column *col,
+			  enum pattern_type type)
+{
+	it->col = col;
+	it->type = type;
+	it->next = list_top(&col->blocks, struct block, list);
+	it->buf = NULL;
+	it->raw = NULL;
+	it->i = it->num = 0;
+}
+
+/* Returns the next block's values (and sets @num), or NULL at the end. */
+static const union val *col_iter_next(struct col_iter *it, size_t *num)
+{
+	const struct block *b = it->next;
+	size_t i;
+
+	if (!b)
+		return NULL;
+	if (b->list.next == &it->col->blocks.n)
+		it->next = NULL;
+	else
+		it->next = list_entry(b->list.next, struct block, list);
+	*num = b->num;
+
+	if (b->vals && b->type == it->type)
+		return b->vals;
+
+	if (!it->buf)
+		it->buf = malloc(sizeof(union val) * BLOCK_MAX_VALS);
+	if (b->vals) {
+		memcpy(it->buf, b->vals, sizeof(union val) * b->num);
+	} else if (b->packed) {
+		unpack_block(b, b->packed, it->buf);
+	} else {
+		if (!it->raw)
+			it->raw = malloc(MAX_PACKED * BLOCK_MAX_VALS);
+		if (pread(spill.fd, it->raw, b->packed_len, b->spill_off)
+		    != (ssize_t)b->packed_len)
+			err(1, "Reading temporary file for --max-memory");
+		unpack_block(b, it->raw, it->buf);
+	}
+	if (b->type != it->type)
+		for (i = 0; i < b->num; i++)
+			val_to_float(&it->buf[i]);
+	return it->buf;
+}
+
+/* One value at a time: returns false at the end. */
+static bool col_iter_val(struct col_iter *it, union val *v)
+{
+	if (it->i == it->num) {
+		it->vals = col_iter_next(it, &it->num);
+		if (!it->vals)
+			return false;
+		it->i = 0;
+	}
+	*v = it->vals[it->i++];
+	return true;
+}
+
+static void col_iter_done(struct col_iter *it)
+{
+	free(it->buf);
+	free(it->raw);
+}
+
+static uint64_t sample_rand(struct sample *s)
+{
+	/* xorshift64* */
+	s->rng ^= s->rng >> 12;
+	s->rng ^= s->rng << 25;
+	s->rng ^= s->rng >> 27;
+	return s->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in (0, 1). */
+static double sample_random(struct sample *s)
+{
+	return ((sample_rand(s) >> 11) + 0.5) / (1ULL << 53);
+}
+
+/* Algorithm L: how far to the next row that goes into the sample. */
+static void sample_skip(struct sample *s, size_t k)
+{
+	s->w *= exp(log(sample_random(s)) / k);
+	s->next += floor(log(sample_random(s)) / log(1 - s->w)) + 1;
+}
+
+/* Seeded from the pattern, so output doesn't vary between runs. */
+static struct sample *new_sample(const struct pattern *p, size_t seed,
+				 size_t max)
+{
+	struct sample *s = malloc(sizeof(*s));
+
+	s->rows = NULL;
+	s->num = s->size = 0;
+	s->max = max;
+	s->rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+	s->w = 1.0;
+	s->next = max;
+	s->acc = malloc(sizeof(*s->acc) * p->num_parts);
+	return s;
+}
+
+static void free_sample(struct sample *s)
+{
+	if (s) {
+		free(s->rows);
+		free(s->acc);
+		free(s);
+	}
+}
+
+static bool val_greater(union val v1, union val v2, enum pattern_type type)
+{
+	if (type == INTEGER)
+		return v1.ival > v2.ival;
+	return v1.dval > v2.dval;
+}
+
+static void accum_add(struct accum *acc, enum pattern_type type,
+		      union val v, bool first)
+{
+	if (first) {
+		acc->min = acc->max = acc->tot = v;
+		return;
+	}
+	if (val_greater(acc->min, v, type))
+		acc->min = v;
+	else if (val_greater(v, acc->max, type))
+		acc->max = v;
+	if (type == INTEGER)
+		acc->tot.ival += v.ival;
+	else
+		acc->tot.dval += v.dval;
+}
+
+/* Keeps a row of values which @line has just counted. */
+static void sample_add(struct line *line, const union val *vals)
+{
+	struct sample *s = line->sample;
+	const struct pattern *p = line->pattern;
+	size_t i, n = p->num_parts;
+	union val *row;
+
+	for (i = 0; i < n; i++)
+		if (p->part[i].type != LITERAL)
+			accum_add(&s->acc[i], p->part[i].type, vals[i],
+				  line->count == 1);
+
+	if (s->num < s->max) {
+		if (s->num == s->size) {
+			s->size = s->size ? s->size * 2 : BLOCK_MIN_VALS;
+			if (s->size > s->max)
+				s->size = s->max;
+			s->rows = realloc(s->rows,
+					  sizeof(union val) * n * s->size);
+		}
+		row = s->rows + n * s->num++;
+		if (s->num == s->max)
+			sample_skip(s, s->max);
+	} else if (line->count == s->next) {
+		row = s->rows + n * (sample_rand(s) % s->max);
+		sample_skip(s, s->max);
+	} else
+		row = NULL;
+
+	if (row)
+		memcpy(row, vals, sizeof(union val) * n);
+}
+
+static void sample_to_float(struct sample *s, size_t num_parts, size_t off)
+{
+	size_t i;
+
+	for (i = 0; i < s->num; i++)
+		val_to_float(&s->rows[i * num_parts + off]);
+	val_to_float(&s->acc[off].min);
+	val_to_float(&s->acc[off].max);
+	val_to_float(&s->acc[off].tot);
+}
+
+/* Combine @from (counted by @count) into @to, as if sampled together. */
+static void sample_merge(struct sample *to, long long to_count,
+			 struct sample *from, long long from_count,
+			 const struct pattern *p)
+{
+	size_t i, n = p->num_parts, num = 0;
+	union val *rows = malloc(sizeof(union val) * n * to->max);
+
+	for (i = 0; i < n; i++) {
+		enum pattern_type type = p->part[i].type;
+
+		if (type == LITERAL)
+			continue;
+		if (val_greater(to->acc[i].min, from->acc[i].min, type))
+			to->acc[i].min = from->acc[i].min;
+		if (val_greater(from->acc[i].max, to->acc[i].max, type))
+			to->acc[i].max = from->acc[i].max;
+		if (type == INTEGER)
+			to->acc[i].tot.ival += from->acc[i].tot.ival;
+		else
+			to->acc[i].tot.dval += from->acc[i].tot.dval;
+	}
+
+	/* Each row we keep stands for count/num of its input's rows. */
+	while (num < to->max && (to->num || from->num)) {
+		struct sample *src;
+		size_t r;
+
+		if (!from->num)
+			src = to;
+		else if (!to->num)
+			src = from;
+		else if (sample_random(to) * (to_count + from_count)
+			 < to_count)
+			src = to;
+		else
+			src = from;
+
+		/* Take a random remaining row. */
+		r = sample_rand(to) % src->num--;
+		memcpy(rows + n * num++, src->rows + n * r,
+		       sizeof(union val) * n);
+		memmove(src->rows + n * r, src->rows + n * src->num,
+			sizeof(union val) * n);
+	}
+	free(to->rows);
+	to->rows = rows;
+	to->num = to->size = num;
+	free_sample(from);
+}
+
+/* How many values each column has (or will have, once flushed). */
+static size_t line_rows(const struct line *line)
+{
+	return line->sample ? line->sample->num : line->count;
+}
+
+/* Put (a copy of) the sampled rows into the columns, ready to print. */
+static void flush_sample(struct line *line)
+{
+	struct sample *s = line->sample;
+	const struct pattern *p = line->pattern;
+	size_t i, r;
+
+	for (r = 0; r < s->num; r++)
+		for (i = 0; i < p->num_parts; i++)
+			if (p->part[i].type != LITERAL)
+				column_add(&line->cols[i], p->part[i].type,
+					   s->rows[r * p->num_parts + i]);
+}
+
+/* Empty the columns again after printing: the sample still has them. */
+static void unflush_sample(struct line *line)
+{
+	size_t i;
+
+	for (i = 0; i < line->pattern->num_parts; i++)
+		column_free(&line->cols[i]);
+}
+
+/* @lock is held while changing types, if tokenizers are comparing them. */
+static void line_to_float(struct line *line, size_t off, pthread_mutex_t *lock)
+{
+	/* Blocks already written are converted as they're read. */
+	if (line->sample)
+		sample_to_float(line->sample, line->pattern->num_parts, off);
+	prof_count(COUNT_PROMOTIONS, 1);
+	if (lock)
+		pthread_mutex_lock(lock);
+	line->pattern->part[off].type = FLOAT;
+	if (lock)
+		pthread_mutex_unlock(lock);
+}
+
+/* Appends a row of values. */
+static void add_vals(struct line *line, const union val *vals)
+{
+	const struct pattern *p = line->pattern;
+	size_t i;
+
+	line->count++;
+	if (line->sample) {
+		sample_add(line, vals);
+		return;
+	}
+	for (i = 0; i < p->num_parts; i++)
+		if (p->part[i].type != LITERAL)
+			column_add(&line->cols[i], p->part[i].type, vals[i]);
+}
+
+static void add_stats(struct line *line, struct pattern *p, union val *vals,
+		      pthread_mutex_t *lock)
+{
+	size_t i;
+
+	for (i = 0; i < p->num_parts; i++) {
+		if (p->part[i].type == LITERAL)
+			continue;
+		if (p->part[i].type == FLOAT
+		    && line->pattern->part[i].type == INTEGER) {
+			line_to_float(line, i, lock);
+		} else if (p->part[i].type == INTEGER
+			   && line->pattern->part[i].type == FLOAT) {
+			val_to_float(&vals[i]);
+			p->part[i].type = FLOAT;
+		}
+		assert(p->part[i].type == line->pattern->part[i].type);
+	}
+	free(p);
+	add_vals(line, vals);
+	free(vals);
+}
+
+/* Each line the table makes us compare is a probe which matched its hash bits. */
+static bool line_eq_counted(const struct line *line, const struct pattern *p)
+{
+	prof_count(COUNT_COMPARES, 1);
+	return line_eq(line, p);
+}
+
+static struct line *linehash_get_hashed(const struct linehash *ht,
+					const struct pattern *p, size_t h)
+{
+	prof_count(COUNT_LOOKUPS, 1);
+#if HAVE_SWISSTABLE
+	return swisstable_get(&ht->raw, h,
+			      (bool (*)(const void *, void *))line_eq_counted,
+			      p);
+#else
+	return htable_get(&ht->raw, h,
+			  (bool (*)(const void *, void *))line_eq_counted, p);
+#endif
+}
+
+/*
+ * Can we trust match_pattern() for this pattern?  Not if a number
+ * failed to parse (leaving a gap between parts), or with --skip or
+ * --key-field (so literals contain varying numbers).
+ */
+static bool predictable(const struct pattern *p)
+{
+	size_t i, j, off = 0;
+
+	for (i = 0; i < p->num_parts; i++) {
+		const struct pattern_part *part = &p->part[i];
+
+		if (part->off != off)
+			return false;
+		off += part->len;
+		/* No --numbers= forms, and no digits in literals. */
+		for (j = 0; j < part->len; j++) {
+			char c = p->text[part->off + j];
+
+			if (part->type == LITERAL && !part->wild ? cisdigit(c)
+			    : !cisdigit(c) && !cisspace(c) && c != '-' && c != '.')
+				return false;
+		}
+	}
+	while (cisspace(p->text[off]))
+		off++;
+	return p->text[off] == '\0';
+}
+
+static void init_line(const struct file *info, struct line *line,
+		      struct pattern *p, union val *vals, size_t h)
+{
+	/* We need to keep a copy of this! */
+	p->text = strdup(p->text);
+	line->pattern = p;
+	line->count = 0;
+	line->error = 0;
+	line->cols = new_columns(p->num_parts);
+	line->sample = info->sample_max
+		? new_sample(p, h, info->sample_max) : NULL;
+	line->succ = NULL;
+	line->predictable = predictable(p);
+	line->derived = NULL;
+	line->corr = NULL;
+	add_vals(line, vals);
+	free(vals);
+	prof_count(COUNT_PATTERNS, 1);
+}
+
+/*
+ * With --max-patterns=N, we keep only the N lines which look most
+ * frequent, using the Space-Saving algorithm: a new pattern replaces
+ * the line with the lowest count, and inherits that count as its
+ * error, so a common pattern which first appears late still gets in.
+ * The input lines counted in what it replaced go in info->other_count.
+ * Lines with a --key-field value aren't in the heap: every key keeps
+ * its line, and they don't count towards N.
+ */
+static bool pattern_keyed(const struct pattern *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->num_parts; i++)
+		if (p->part[i].key)
+			return true;
+	return false;
+}
+
+static long long line_weight(const struct line *line)
+{
+	return line->count + line->error;
+}
+
+static void heap_sift_down(struct file *info, size_t i)
+{
+	struct heap_entry *heap = info->heap, e = heap[i];
+
+	for (;;) {
+		size_t child = i * 2 + 1;
+
+		if (child >= info->heap_num)
+			break;
+		if (child + 1 < info->heap_num
+		    && heap[child + 1].weight < heap[child].weight)
+			child++;
+		if (heap[child].weight >= e.weight)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+static void heap_push(struct file *info, struct line *line)
+{
+	size_t i = info->heap_num++;
+
+	if (info->heap_num > info->heap_max) {
+		info->heap_max = info->heap_num * 2;
+		info->heap = realloc(info->heap,
+				     sizeof(*info->heap) * info->heap_max);
+	}
+	while (i > 0 && info->heap[(i - 1) / 2].weight > line_weight(line)) {
+		info->heap[i] = info->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	info->heap[i].weight = line_weight(line);
+	info->heap[i].line = line;
+}
+
+/*
+ * Adding a row doesn't touch the heap, but weights only ever go up: if
+ * the top entry's weight is still right it's the least, otherwise
+ * update it and look again.
+ */
+static struct line *heap_min(struct file *info)
+{
+	while (info->heap[0].weight != line_weight(info->heap[0].line)) {
+		info->heap[0].weight = line_weight(info->heap[0].line);
+		heap_sift_down(info, 0);
+	}
+	return info->heap[0].line;
+}
+
+/* Count a line as "other" and free what it holds (but not the line). */
+static void evict_line(struct file *info, struct line *line, bool shared)
+{
+	size_t i, h = pattern_hash(line->pattern);
+	struct line_shard *shard = line_shard(info, h);
+
+	if (shared)
+		pthread_mutex_lock(&shard->lock);
+	linehash_del(&shard->patterns, line);
+	if (shared)
+		pthread_mutex_unlock(&shard->lock);
+	list_del_from(&info->lines, &line->list);
+
+	info->other_count += line->count;
+	prof_count(COUNT_EVICTIONS, 1);
+	for (i = 0; i < line->pattern->num_parts; i++)
+		column_free(&line->cols[i]);
+	free(line->cols);
+	free_sample(line->sample);
+	free((char *)line->pattern->text);
+	free(line->pattern);
+}
+
+/*
+ * @shared is set when tokenizer threads are reading the table: this is
+ * still the only thread which changes it, so it only locks to do so.
+ */
+static struct line *add_pattern(struct file *info, struct pattern *p,
+				union val *vals, size_t h, bool shared)
+{
+	struct line_shard *shard = line_shard(info, h);
+	struct line *line;
+	bool keyed;
+	uint64_t start = prof_start();
+
+	line = linehash_get_hashed(&shard->patterns, p, h);
+	start = prof_next(PHASE_LOOKUP, start);
+	if (line) {
+		add_stats(line, p, vals, shared ? &shard->lock : NULL);
+		prof_next(PHASE_ADD, start);
+		return line;
+	}
+
+	keyed = info->key_field && pattern_keyed(p);
+	if (info->max_patterns && info->heap_num == info->max_patterns
+	    && !keyed) {
+		long long weight;
+
+		line = heap_min(info);
+		weight = line_weight(line);
+		evict_line(info, line, shared);
+		init_line(info, line, p, vals, h);
+		line->error = weight;
+		info->heap[0].weight = line_weight(line);
+		heap_sift_down(info, 0);
+	} else {
+		line = malloc(sizeof(*line));
+		init_line(info, line, p, vals, h);
+		if (info->max_patterns && !keyed)
+			heap_push(info, line);
+	}
+
+	if (shared)
+		pthread_mutex_lock(&shard->lock);
+	linehash_add(&shard->patterns, line);
+	if (shared)
+		pthread_mutex_unlock(&shard->lock);
+	list_add_tail(&info->lines, &line->list);
+	prof_next(PHASE_ADD, start);
+	return line;
+}
+
+/*
+ * Tokenizer threads find (or insert) the line for each pattern.  A new
+ * line gets a placeholder pattern with count 0: its real pattern comes
+ * from whichever record for it is first in input order.
+ */
+static struct line *get_shared_line(struct file *info,
+				    const struct pattern *p, size_t h)
+{
+	struct line_shard *shard = line_shard(info, h);
+	struct line *line;
+
+	pthread_mutex_lock(&shard->lock);
+	line = linehash_get_hashed(&shard->patterns, p, h);
+	/* With --max-patterns, add_shared_line() adds them instead. */
+	if (!line && !info->max_patterns) {
+		line = malloc(sizeof(*line));
+		line->pattern = malloc(partsize(p->num_parts));
+		memcpy(line->pattern, p, partsize(p->num_parts));
+		line->pattern->text = strdup(p->text);
+		line->count = 0;
+		line->error = 0;
+		line->cols = new_columns(p->num_parts);
+		line->sample = info->sample_max
+			? new_sample(p, h, info->sample_max) : NULL;
+		line->succ = NULL;
+		line->predictable = false;
+		line->derived = NULL;
+		line->corr = NULL;
+		linehash_add(&shard->patterns, line);
+		prof_count(COUNT_PATTERNS, 1);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return line;
+}
+
+static void add_shared_line(struct file *info, struct line *line,
+			    struct pattern *p, union val *vals, size_t h)
+{
+	struct line_shard *shard = line_shard(info, h);
+	uint64_t start;
+
+	if (info->max_patterns) {
+		/* It may have been replaced since the lookup. */
+		if (line && line_eq(line, p)) {
+			start = prof_start();
+			add_stats(line, p, vals, &shard->lock);
+			prof_next(PHASE_ADD, start);
+		} else
+			add_pattern(info, p, vals, h, true);
+		return;
+	}
+
+	start = prof_start();
+
+	if (line->count == 0) {
+		struct pattern *placeholder = line->pattern;
+
+		p->text = strdup(p->text);
+		pthread_mutex_lock(&shard->lock);
+		line->pattern = p;
+		pthread_mutex_unlock(&shard->lock);
+		free((char *)placeholder->text);
+		free(placeholder);
+
+		add_vals(line, vals);
+		free(vals);
+		list_add_tail(&info->lines, &line->list);
+	} else
+		add_stats(line, p, vals, &shard->lock);
+	prof_next(PHASE_ADD, start);
+}
+
+/*
+ * Does @str tokenize to pattern @p?  If so, fill in the values and
+ * types of its numeric parts, without building a new pattern.  This
+ * has to agree exactly with get_pattern().
+ */
+static bool match_pattern(const struct pattern *p, const char *str,
+			  unsigned forms, union val *vals,
+			  enum pattern_type *types)
+{
+	const char *s = str;
+	size_t i;
+
+	for (i = 0; i < p->num_parts; i++) {
+		const struct pattern_part *part = &p->part[i];
+		const char *num;
+		unsigned char unit;
+		char *end;
+
+		if (part->type == LITERAL && !part->wild) {
+			if (strncmp(s, p->text + part->off, part->len) != 0)
+				return false;
+			s += part->len;
+			/* get_pattern() would have started a number at "-5". */
+			if (s[-1] == '-' && cisdigit(*s))
+				return false;
+			continue;
+		}
+
+		/* "1-2" is a number, a literal and a number, not two. */
+		if (i > 0 && (p->part[i-1].type != LITERAL || p->part[i-1].wild)
+		    && !cisspace(*s))
+			return false;
+		while (cisspace(*s))
+			s++;
+		num = s;
+		if (*s == '-')
+			s++;
+		if (!cisdigit(*s))
+			return false;
+		while (cisdigit(*s))
+			s++;
+		if (*s == '.' && cisdigit(s[1])) {
+			s++;
+			while (cisdigit(*s))
+				s++;
+			types[i] = FLOAT;
+			if (part->wild)
+				end = (char *)s;
+			else
+				vals[i].dval = strtod(num, &end);
+		} else {
+			types[i] = INTEGER;
+			if (part->wild)
+				end = (char *)s;
+			else
+				vals[i].ival = strtoll(num, &end, 10);
+		}
+		/* Let get_pattern() complain about it. */
+		if (end != s)
+			return false;
+		/* Or work out whether it's one of the --numbers= forms. */
+		if (forms && *s && !cisspace(*s)
+		    && extend_number(num, s, forms, &types[i], &vals[i], &unit))
+			return false;
+	}
+
+	/* Trailing whitespace is ignored. */
+	while (cisspace(*s))
+		s++;
+	return *s == '\0';
+}
+
+static void match_reserve(struct file *info, size_t num_parts)
+{
+	if (num_parts > info->match_max) {
+		info->match_max = num_parts;
+		info->match_vals = realloc(info->match_vals,
+					   valsize(info->match_max));
+		info->match_types = realloc(info->match_types,
+					    sizeof(*info->match_types)
+					    * info->match_max);
+	}
+}
+
+/* Add a row of @types (for @line's numeric parts): as add_stats() does. */
+static void add_typed_vals(struct line *line, union val *vals,
+			   const enum pattern_type *types)
+{
+	const struct pattern *p = line->pattern;
+	size_t i;
+
+	for (i = 0; i < p->num_parts; i++) {
+		if (p->part[i].type == LITERAL)
+			continue;
+		if (types[i] == FLOAT && p->part[i].type == INTEGER)
+			line_to_float(line, i, NULL);
+		else if (types[i] == INTEGER && p->part[i].type == FLOAT)
+			val_to_float(&vals[i]);
+	}
+	add_vals(line, vals);
+}
+
+/* If @str matches @line, add it there. */
+static bool add_predicted(struct file *info, struct line *line,
+			  const char *str)
+{
+	const struct pattern *p = line->pattern;
+	uint64_t start = prof_start();
+	bool match;
+
+	match_reserve(info, p->num_parts);
+	match = match_pattern(p, str, info->number_forms,
+			      info->match_vals, info->match_types);
+	start = prof_next(PHASE_TOKENIZE, start);
+	if (!match)
+		return false;
+	add_typed_vals(line, info->match_vals, info->match_types);
+	prof_next(PHASE_ADD, start);
+	prof_count(COUNT_PREDICTED, 1);
+	return true;
+}
+
+/*
+ * Logs tend to cycle through the same lines in the same order, so
+ * first try whichever line followed the last one last time: that
+ * avoids building a pattern, hashing it and looking it up.
+ */
+static void add_line(struct file *info, unsigned skip, const char *str)
+{
+	struct line *line = info->last ? info->last->succ : NULL;
+	struct pattern *p;
+	union val *vals;
+
+	prof_count(COUNT_LINES, 1);
+	if (filtering(info) && !filter_line(info, str, strlen(str))) {
+		prof_count(COUNT_FILTERED, 1);
+		return;
+	}
+	if (!line || !line->predictable || !add_predicted(info, line, str)) {
+		uint64_t start = prof_start();
+		size_t h;
+
+		p = get_pattern(str, skip, info, &vals);
+		h = pattern_hash(p);
+		prof_next(PHASE_TOKENIZE, start);
+		line = add_pattern(info, p, vals, h, false);
+	}
+	if (info->last)
+		info->last->succ = line;
+	info->last = line;
+}
+
+/* Merging can leave too many lines: throw away the least frequent. */
+static void trim_lines(struct file *info)
+{
+	struct line *l;
+
+	info->heap_num = 0;
+	list_for_each(&info->lines, l, list)
+		if (!pattern_keyed(l->pattern))
+			heap_push(info, l);
+	while (info->heap_num > info->max_patterns) {
+		l = heap_min(info);
+		evict_line(info, l, false);
+		free(l);
+		info->heap[0] = info->heap[--info->heap_num];
+		heap_sift_down(info, 0);
+	}
+	/* Predictions could point at the lines we freed. */
+	info->last = NULL;
+	list_for_each(&info->lines, l, list)
+		l->succ = NULL;
+}
+
+/* Append everything in @from to @to, as if it had been read afterwards. */
+static void merge_file(struct file *to, struct file *from)
+{
+	struct line *l;
+
+	while ((l = list_pop(&from->lines, struct line, list)) != NULL) {
+		size_t i, h = pattern_hash(l->pattern);
+		struct linehash *patterns = &line_shard(to, h)->patterns;
+		struct line *line;
+
+		line = linehash_get_hashed(patterns, l->pattern, h);
+		if (!line) {
+			l->succ = NULL;
+			linehash_add(patterns, l);
+			list_add_tail(&to->lines, &l->list);
+			continue;
+		}
+
+		for (i = 0; i < l->pattern->num_parts; i++) {
+			enum pattern_type type = l->pattern->part[i].type;
+
+			if (type == FLOAT
+			    && line->pattern->part[i].type == INTEGER)
+				line_to_float(line, i, NULL);
+			else if (type == INTEGER
+				 && line->pattern->part[i].type == FLOAT)
+				line_to_float(l, i, NULL);
+		}
+		for (i = 0; i < l->pattern->num_parts; i++)
+			list_append_list(&line->cols[i].blocks,
+					 &l->cols[i].blocks);
+		if (line->sample)
+			sample_merge(line->sample, line->count,
+				     l->sample, l->count, line->pattern);
+		line->count += l->count;
+		line->error += l->error;
+		free(l->cols);
+		free((char *)l->pattern->text);
+		free(l->pattern);
+		free(l);
+	}
+
+	to->other_count += from->other_count;
+	if (to->max_patterns)
+		trim_lines(to);
+}
+
+static void flush_samples(struct file *info)
+{
+	struct line *l;
+
+	list_for_each(&info->lines, l, list)
+		if (l->sample)
+			flush_sample(l);
+}
+
+static void unflush_samples(struct file *info)
+{
+	struct line *l;
+
+	list_for_each(&info->lines, l, list)
+		if (l->sample)
+			unflush_sample(l);
+}
+
+/*
+ * At the end of an input, pack the unfinished blocks with --compress,
+ * and over --max-memory write out whole lines until we're not.
+ */
+static void finish_lines(struct file *info)
+{
+	struct line *l;
+	struct block *b;
+	size_t i;
+
+	if (spill.compress) {
+		list_for_each(&info->lines, l, list)
+			for (i = 0; i < l->pattern->num_parts; i++)
+				list_for_each(&l->cols[i].blocks, b, list)
+					if (b->vals)
+						pack_block(b);
+	}
+
+	list_for_each(&info->lines, l, list) {
+		if (!over_budget())
+			break;
+		for (i = 0; i < l->pattern->num_parts; i++)
+			list_for_each(&l->cols[i].blocks, b, list)
+				if (b->vals || b->packed)
+					spill_block(b);
+	}
+}
+
+/*
+ * Big read buffers are allocated on huge page boundaries, and we ask
+ * for them to be backed by huge pages: it saves TLB misses as we
+ * scan them.  Otherwise this behaves like realloc().
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static void *resize_buffer(void *buf, size_t len)
+{
+	size_t alloc = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	void *new;
+
+	if (len < HUGE_PAGE_SIZE)
+		return realloc(buf, len);
+
+	errno = posix_memalign(&new, HUGE_PAGE_SIZE, alloc);
+	if (errno)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	madvise(new, alloc, MADV_HUGEPAGE);
+#endif
+	if (buf) {
+		size_t old = malloc_usable_size(buf);
+		memcpy(new, buf, old < len ? old : len);
+		free(buf);
+	}
+	return new;
+}
+
+/* Size we start reading with: buffers only grow for longer lines. */
+#define READ_BUFFER_SIZE (256 * 1024)
+
+/*
+ * Pipelined input: one reader thread cuts the input into large batches
+ * of whole lines, tokenizer threads run get_pattern() over each batch,
+ * and the caller applies the results in input order.  The batches live
+ * in a bounded ring, so memory use doesn't depend on input size.
+ */
+#define BATCH_SIZE (1024 * 1024)
+
+enum batch_state {
+	BATCH_EMPTY,
+	BATCH_FILLED,
+	BATCH_TOKENIZED
+};
+
+struct record {
+	struct line *line;
+	struct pattern *p;
+	union val *vals;
+	size_t hash;
+};
+
+struct batch {
+	enum batch_state state;
+	/* Whole lines (the last may lack a '\n'), plus room for a NUL. */
+	char *buf;
+	size_t len, max;
+	struct record *recs;
+	size_t num_recs, max_recs;
+};
+
+struct pipeline {
+	struct file *info;
+	struct input *in;
+	unsigned skip;
+	/* Longest (partial) line we'll hold (0 == unlimited). */
+	size_t max_line;
+
+	pthread_mutex_t lock;
+	/* Signalled when a batch changes state. */
+	pthread_cond_t changed;
+	/* Sequence numbers: next to read, next to tokenize. */
+	size_t read_seq, tok_seq;
+	/* Set once the reader has published its last batch. */
+	bool eof;
+	int read_errno;
+
+	size_t num_batches;
+	struct batch *batch;
+};
+
+static struct batch *pipeline_batch(struct pipeline *pl, size_t seq)
+{
+	return &pl->batch[seq % pl->num_batches];
+}
+
+static void wait_for_state(struct pipeline *pl, struct batch *b,
+			   enum batch_state state)
+{
+	while (b->state != state)
+		pthread_cond_wait(&pl->changed, &pl->lock);
+}
+
+static void set_state(struct pipeline *pl, struct batch *b,
+		      enum batch_state state)
+{
+	pthread_mutex_lock(&pl->lock);
+	b->state = state;
+	pthread_cond_broadcast(&pl->changed);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+static void batch_reserve(struct batch *b, size_t len)
+{
+	if (b->max < len + 1) {
+		b->max = len + 1;
+		b->buf = resize_buffer(b->buf, b->max);
+		if (!b->buf)
+			err(1, "Allocating %zu byte batch", b->max);
+	}
+}
+
+/*
+ * Do the @len bytes at @p keep every line shorter than @max (as rbuf
+ * needs them to be, reading on one thread)?  @line_len is how long the
+ * line they continue is so far; if not, @start is set to where the
+ * line which is too long starts in @p (or to NULL, if before it).
+ */
+static bool lines_fit(const char *p, size_t len, size_t max,
+		      size_t *line_len, const char **start)
+{
+	const char *s = p, *end = p + len, *nl;
+
+	for (;;) {
+		nl = memchr(s, '\n', end - s);
+		if (*line_len + ((nl ? nl : end) - s) >= max) {
+			*start = *line_len ? NULL : s;
+			return false;
+		}
+		if (!nl)
+			break;
+		*line_len = 0;
+		s = nl + 1;
+	}
+	*line_len += end - s;
+	return true;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	char *carry = NULL;
+	size_t carry_len = 0, line_len = 0;
+	bool eof = false;
+	int read_errno = 0;
+
+	while (!eof) {
+		struct batch *b = pipeline_batch(pl, pl->read_seq);
+		bool seen_nl = carry_len && memchr(carry, '\n', carry_len);
+		const char *too_long = NULL;
+		char *nl;
+
+		pthread_mutex_lock(&pl->lock);
+		wait_for_state(pl, b, BATCH_EMPTY);
+		pthread_mutex_unlock(&pl->lock);
+
+		batch_reserve(b, carry_len + BATCH_SIZE);
+		if (carry_len) {
+			memcpy(b->buf, carry, carry_len);
+			prof_count(COUNT_BUF_COPIED, carry_len);
+		}
+		b->len = carry_len;
+
+		/* Fill the batch, and keep going until we see a '\n'. */
+		for (;;) {
+			uint64_t start;
+			ssize_t r;
+
+			/* A batch only fills up without a '\n' if it
+			 * holds part of a single line. */
+			if (b->len == b->max - 1) {
+				batch_reserve(b, b->len * 2);
+				prof_count(COUNT_BUF_GROWS, 1);
+			}
+			start = prof_start_all();
+			r = input_read(pl->in, b->buf + b->len,
+				       b->max - 1 - b->len);
+			prof_next_all(PHASE_READ, start);
+			if (r <= 0) {
+				if (r < 0)
+					read_errno = errno;
+				eof = true;
+				break;
+			}
+			prof_count(COUNT_BYTES, r);
+			if (pl->max_line
+			    && !lines_fit(b->buf + b->len, r, pl->max_line,
+					  &line_len, &too_long)) {
+				/* Keep the lines before it. */
+				if (!too_long) {
+					nl = memrchr(b->buf, '\n', b->len);
+					too_long = nl ? nl + 1 : b->buf;
+				}
+				b->len = too_long - b->buf;
+				read_errno = ENOBUFS;
+				eof = true;
+				break;
+			}
+			if (!seen_nl)
+				seen_nl = memchr(b->buf + b->len, '\n', r);
+			b->len += r;
+			if (b->len >= BATCH_SIZE && seen_nl)
+				break;
+		}
+
+		/* Partial last line goes to the next batch. */
+		carry_len = 0;
+		if (!eof) {
+			nl = memrchr(b->buf, '\n', b->len);
+			carry_len = b->buf + b->len - (nl + 1);
+			if (carry_len) {
+				carry = realloc(carry, carry_len);
+				memcpy(carry, nl + 1, carry_len);
+				prof_count(COUNT_BUF_COPIED, carry_len);
+			}
+			b->len -= carry_len;
+		}
+
+		pthread_mutex_lock(&pl->lock);
+		b->state = BATCH_FILLED;
+		pl->read_seq++;
+		if (eof) {
+			pl->eof = true;
+			pl->read_errno = read_errno;
+		}
+		pthread_cond_broadcast(&pl->changed);
+		pthread_mutex_unlock(&pl->lock);
+	}
+	free(carry);
+	return NULL;
+}
+
+static void tokenize_batch(struct file *info, struct batch *b, unsigned skip)
+{
+	char *line, *nl, *end = b->buf + b->len;
+	size_t lines = 0;
+
+	b->num_recs = 0;
+	for (line = b->buf; line < end; line = nl + 1) {
+		struct record *rec;
+		uint64_t start;
+
+		nl = memchr(line, '\n', end - line);
+		if (!nl)
+			nl = end;
+		*nl = '\0';
+		lines++;
+		if (filtering(info) && !filter_line(info, line, nl - line)) {
+			prof_count(COUNT_FILTERED, 1);
+			continue;
+		}
+
+		if (b->num_recs == b->max_recs) {
+			b->max_recs = b->max_recs * 2 + 64;
+			b->recs = realloc(b->recs,
+					  sizeof(*b->recs) * b->max_recs);
+		}
+		rec = &b->recs[b->num_recs++];
+		start = prof_start();
+		rec->p = get_pattern(line, skip, info, &rec->vals);
+		rec->hash = pattern_hash(rec->p);
+		start = prof_next(PHASE_TOKENIZE, start);
+		rec->line = get_shared_line(info, rec->p, rec->hash);
+		prof_next(PHASE_LOOKUP, start);
+	}
+	prof_count(COUNT_LINES, lines);
+}
+
+static void *tokenizer_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+
+	pthread_mutex_lock(&pl->lock);
+	for (;;) {
+		struct batch *b;
+
+		while (pl->tok_seq == pl->read_seq && !pl->eof)
+			pthread_cond_wait(&pl->changed, &pl->lock);
+		if (pl->tok_seq == pl->read_seq)
+			break;
+
+		b = pipeline_batch(pl, pl->tok_seq++);
+		pthread_mutex_unlock(&pl->lock);
+
+		tokenize_batch(pl->info, b, pl->skip);
+
+		pthread_mutex_lock(&pl->lock);
+		b->state = BATCH_TOKENIZED;
+		pthread_cond_broadcast(&pl->changed);
+	}
+	pthread_mutex_unlock(&pl->lock);
+	return NULL;
+}
+
+/* Returns false (with errno set) if reading failed. */
+static bool read_pipelined(struct file *info, struct input *in,
+			   unsigned skip, unsigned threads, size_t max_line)
+{
+	struct pipeline pl;
+	pthread_t reader, *tokenizers = malloc(sizeof(*tokenizers) * threads);
+	size_t i, seq;
+
+	pl.info = info;
+	pl.in = in;
+	pl.skip = skip;
+	pl.max_line = max_line;
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.changed, NULL);
+	pl.read_seq = pl.tok_seq = 0;
+	pl.eof = false;
+	pl.read_errno = 0;
+	/* Enough to keep every tokenizer busy while we aggregate. */
+	pl.num_batches = threads * 2 + 2;
+	pl.batch = calloc(pl.num_batches, sizeof(*pl.batch));
+
+	if (pthread_create(&reader, NULL, reader_thread, &pl) != 0)
+		err(1, "Creating reader thread");
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tokenizers[i], NULL, tokenizer_thread,
+				   &pl) != 0)
+			err(1, "Creating tokenizer thread");
+
+	for (seq = 0; ; seq++) {
+		struct batch *b = pipeline_batch(&pl, seq);
+		bool done;
+
+		pthread_mutex_lock(&pl.lock);
+		while (b->state != BATCH_TOKENIZED
+		       && !(pl.eof && seq == pl.read_seq))
+			pthread_cond_wait(&pl.changed, &pl.lock);
+		done = (b->state != BATCH_TOKENIZED);
+		pthread_mutex_unlock(&pl.lock);
+		if (done)
+			break;
+
+		for (i = 0; i < b->num_recs; i++)
+			add_shared_line(info, b->recs[i].line, b->recs[i].p,
+					b->recs[i].vals, b->recs[i].hash);
+		set_state(&pl, b, BATCH_EMPTY);
+	}
+
+	pthread_join(reader, NULL);
+	for (i = 0; i < threads; i++)
+		pthread_join(tokenizers[i], NULL);
+	free(tokenizers);
+
+	for (i = 0; i < pl.num_batches; i++) {
+		free(pl.batch[i].buf);
+		free(pl.batch[i].recs);
+	}
+	free(pl.batch);
+	pthread_cond_destroy(&pl.changed);
+	pthread_mutex_destroy(&pl.lock);
+
+	errno = pl.read_errno;
+	return errno == 0;
+}
+
+static bool spacestart(const struct pattern *p, size_t off)
+{
+	return cisspace(p->text[p->part[off].off]);
+}
+
+/* Numbers we didn't analyze could have been anything. */
+static void print_wild(FILE *out, const struct pattern *p, size_t off)
+{
+	fprintf(out, "%s*", spacestart(p, off) ? " " : "");
+}
+
+static void print_literal_part(FILE *out, const struct pattern *p, size_t off)
+{
+	if (p->part[off].wild)
+		print_wild(out, p, off);
+	else
+		fprintf(out, "%.*s", (int)p->part[off].len,
+			p->text + p->part[off].off);
+}
+
+static inline bool greater_double(union val v1, union val v2)
+{
+	return v1.dval > v2.dval;
+}
+
+static inline union val add_double(union val v1, union val v2)
+{
+	union val v;
+	v.dval = v1.dval + v2.dval;
+	return v;
+}
+
+static inline union val sub_double(union val v1, union val v2)
+{
+	union val v;
+	v.dval = v1.dval - v2.dval;
+	return v;
+}
+
+static inline union val div_double(union val v, size_t num)
+{
+	v.dval /= num;
+	return v;
+}
+
+static inline double double_to_double(union val v)
+{
+	return v.dval;
+}
+
+static inline void print_double(FILE *out, union val val)
+{
+	fprintf(out, "%lf", val.dval);
+}
+
+static inline bool greater_int(union val v1, union val v2)
+{
+	return v1.ival > v2.ival;
+}
+
+static inline union val add_int(union val v1, union val v2)
+{
+	union val v;
+	v.ival = v1.ival + v2.ival;
+	return v;
+}
+
+static inline union val sub_int(union val v1, union val v2)
+{
+	union val v;
+	v.ival = v1.ival - v2.ival;
+	return v;
+}
+
+static inline union val div_int(union val v, size_t num)
+{
+	v.ival /= num;
+	return v;
+}
+
+static inline double int_to_double(union val v)
+{
+	return (double)v.ival;
+}
+
+static inline void print_int(FILE *out, union val val)
+{
+	fprintf(out, "%lli", val.ival);
+}
+
+struct val_ops {
+	bool (*greater)(union val v1, union val v2);
+	union val (*add)(union val v1, union val v2);
+	union val (*sub)(union val v1, union val v2);
+	union val (*div)(union val v, size_t num);
+	double (*to_double)(union val v);
+	void (*print)(FILE *out, union val v);
+};
+
+static const struct val_ops double_ops = {
+	greater_double, add_double, sub_double, div_double,
+	double_to_double, print_double
+};
+
+static const struct val_ops int_ops = {
+	greater_int, add_int, sub_int, div_int, int_to_double, print_int
+};
+
+static const struct val_ops *part_ops(const struct pattern *p, size_t off)
+{
+	switch (p->part[off].type) {
+	case FLOAT:
+		return &double_ops;
+	case INTEGER:
+		return &int_ops;
+	default:
+		abort();
+	}
+}
+
+/* Summary of one numeric field of a line. */
+struct val_stats {
+	size_t num;
+	union val min, max;
+	double avg, stddev;
+};
+
+static void analyze_vals(const struct column *col, enum pattern_type type,
+			 const struct val_ops *ops,
+			 union val *min, union val *max, union val *tot,
+			 size_t *num)
+{
+	struct col_iter it;
+	union val v;
+
+	*num = 0;
+	col_iter_init(&it, col, type);
+	while (col_iter_val(&it, &v)) {
+		if (!*num) {
+			*min = *max = *tot = v;
+		} else {
+			if (ops->greater(*min, v))
+				*min = v;
+			else if (ops->greater(v, *max))
+				*max = v;
+			*tot = ops->add(*tot, v);
+		}
+		(*num)++;
+	}
+	col_iter_done(&it);
+}
+
+/* min-max(avg+/-stddev) */
+static void print_summary(FILE *out, const struct val_stats *st,
+			  const struct val_ops *ops)
+{
+	ops->print(out, st->min);
+	fputc('-', out);
+	ops->print(out, st->max);
+	fprintf(out, "(%g+/-%.2g)", st->avg, st->stddev);
+}
+
+static void print_one(FILE *out, const struct pattern *p, size_t off,
+		      const struct val_stats *st, const struct val_ops *ops)
+{
+	if (spacestart(p, off))
+		fputc(' ', out);
+	print_summary(out, st, ops);
+	fputs(unit_names[p->part[off].unit], out);
+}
+
+static double get_stddev(const struct column *col, enum pattern_type type,
+			 double avg, union val min, union val max,
+			 bool trim_out,
+			 double (*to_double)(union val v))
+{
+	struct col_iter it;
+	union val v;
+	double variance = 0.0;
+	unsigned num = 0;
+
+	col_iter_init(&it, col, type);
+	while (col_iter_val(&it, &v)) {
+		double d = to_double(v);
+		variance += (d - avg) * (d - avg);
+		num++;
+	}
+	col_iter_done(&it);
+
+	if (trim_out) {
+		double d = to_double(min);
+		variance -= (d - avg) * (d - avg);
+		d = to_double(max);
+		variance -= (d - avg) * (d - avg);
+		num -= 2;
+	}
+
+	return sqrt(variance / num);
+}
+
+/*
+ * Given the min, max and number of values in @st, and their total,
+ * the average and deviation of @col.  @whole is false if @col is only
+ * a sample of them.
+ */
+static void get_spread(const struct column *col, enum pattern_type type,
+		       union val tot, bool trim_out, bool whole,
+		       const struct val_ops *ops, struct val_stats *st)
+{
+	if (st->num < 3)
+		trim_out = false;
+	if (trim_out) {
+		tot = ops->sub(tot, st->max);
+		tot = ops->sub(tot, st->min);
+		st->avg = ops->to_double(tot) / (st->num - 2);
+	} else
+		st->avg = ops->to_double(tot) / st->num;
+
+	/* A partial sample needn't include the min and max to trim. */
+	if (!whole)
+		trim_out = false;
+	st->stddev = get_stddev(col, type, st->avg, st->min, st->max,
+				trim_out, ops->to_double);
+}
+
+static void get_val_stats(const struct line *l, size_t off,
+			  bool trim_out, const struct val_ops *ops,
+			  struct val_stats *st)
+{
+	enum pattern_type type = l->pattern->part[off].type;
+	union val tot;
+
+	/* Sampled: all but the deviation are exact. */
+	if (l->sample) {
+		st->min = l->sample->acc[off].min;
+		st->max = l->sample->acc[off].max;
+		tot = l->sample->acc[off].tot;
+		st->num = l->count;
+	} else
+		analyze_vals(&l->cols[off], type, ops,
+			     &st->min, &st->max, &tot, &st->num);
+	get_spread(&l->cols[off], type, tot, trim_out,
+		   line_rows(l) == l->count, ops, st);
+}
+
+/* The same for a --derive column (of floats). */
+static void get_derived_stats(const struct column *col, bool trim_out,
+			      struct val_stats *st)
+{
+	union val tot;
+
+	analyze_vals(col, FLOAT, &double_ops, &st->min, &st->max, &tot,
+		     &st->num);
+	get_spread(col, FLOAT, tot, trim_out, true, &double_ops, st);
+}
+
+static void print_val(FILE *out, const struct line *l, size_t off,
+		      bool trim_out)
+{
+	const struct val_ops *ops = part_ops(l->pattern, off);
+	struct val_stats st;
+
+	get_val_stats(l, off, trim_out, ops, &st);
+	print_one(out, l->pattern, off, &st, ops);
+}
+
+static bool column_invariant(const struct column *col, enum pattern_type type)
+{
+	struct col_iter it;
+	union val first, v;
+	bool same = true;
+
+	col_iter_init(&it, col, type);
+	col_iter_val(&it, &first);
+	while (col_iter_val(&it, &v)) {
+		if (memcmp(&first, &v, sizeof(v)) != 0) {
+			same = false;
+			break;
+		}
+	}
+	col_iter_done(&it);
+	return same;
+}
+
+/*
+ * With --key-field, each key gets a line of its own: we print the lines
+ * which only differ by key together, where the first of them appeared.
+ * A template is a pattern without its key's value.
+ */
+static size_t template_hash(const struct pattern *p)
+{
+	size_t i;
+	size_t h = p->num_parts;
+
+	for (i = 0; i < p->num_parts; i++) {
+		const struct pattern_part *part = &p->part[i];
+
+		if (part->type == LITERAL) {
+			if (!part->wild && !part->key)
+				h = hash(p->text + part->off, part->len, h);
+		} else if (part->unit)
+			h = hash(&part->unit, 1, h);
+	}
+	return h;
+}
+
+struct template_rank {
+	struct line *line;
+	size_t hash, order, group;
+};
+
+static int cmp_template_hash(const void *a, const void *b)
+{
+	const struct template_rank *ra = a, *rb = b;
+
+	if (ra->hash != rb->hash)
+		return ra->hash < rb->hash ? -1 : 1;
+	return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+static int cmp_template_group(const void *a, const void *b)
+{
+	const struct template_rank *ra = a, *rb = b;
+
+	if (ra->group != rb->group)
+		return ra->group < rb->group ? -1 : 1;
+	return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+static void group_keyed_lines(struct file *info)
+{
+	struct template_rank *r;
+	struct line *l;
+	size_t i, j, start, n = 0;
+
+	list_for_each(&info->lines, l, list)
+		n++;
+	r = malloc(sizeof(*r) * n);
+	n = 0;
+	list_for_each(&info->lines, l, list) {
+		r[n].line = l;
+		r[n].hash = template_hash(l->pattern);
+		r[n].order = n;
+		n++;
+	}
+
+	/* Each line's group is the first line with its template. */
+	qsort(r, n, sizeof(*r), cmp_template_hash);
+	for (start = i = 0; i < n; i++) {
+		if (r[i].hash != r[start].hash)
+			start = i;
+		for (j = start; j < i; j++)
+			if (parts_eq(r[j].line->pattern, r[i].line->pattern,
+				     true))
+				break;
+		r[i].group = r[j].order;
+	}
+	qsort(r, n, sizeof(*r), cmp_template_group);
+
+	list_head_init(&info->lines);
+	for (i = 0; i < n; i++)
+		list_add_tail(&info->lines, &r[i].line->list);
+	free(r);
+}
+
+/* Numbers which are always the same are actually literals. */
+static void find_literal_numbers(struct file *info)
+{
+	struct line *l;
+
+	list_for_each(&info->lines, l, list) {
+		size_t i;
+
+		for (i = 0; i < l->pattern->num_parts; i++) {
+			enum pattern_type type = l->pattern->part[i].type;
+			bool same;
+
+			if (type == LITERAL)
+				continue;
+			/* A sample might be all the same when the rest isn't. */
+			if (l->sample)
+				same = !memcmp(&l->sample->acc[i].min,
+					       &l->sample->acc[i].max,
+					       sizeof(union val));
+			else
+				same = column_invariant(&l->cols[i], type);
+			if (same) {
+				l->pattern->part[i].number_type = type;
+				l->pattern->part[i].type = LITERAL;
+			}
+		}
+	}
+}
+
+/* Undo find_literal_numbers(), so we can keep adding lines. */
+static void restore_literal_numbers(struct file *info)
+{
+	struct line *l;
+
+	list_for_each(&info->lines, l, list) {
+		size_t i;
+
+		for (i = 0; i < l->pattern->num_parts; i++) {
+			struct pattern_part *part = &l->pattern->part[i];
+
+			if (part->number_type != LITERAL) {
+				part->type = part->number_type;
+				part->number_type = LITERAL;
+			}
+		}
+	}
+}
+
+/*
+ * Which part holds the @field'th number (from 1, as --fields counts
+ * them) of @l, and its type: -1 if it has no values.  This works after
+ * find_literal_numbers(), too.
+ */
+static long field_part(const struct file *info, const struct line *l,
+		       size_t field, enum pattern_type *type)
+{
+	const struct pattern *p = l->pattern;
+	size_t i;
+
+	/* The key is part of the literal text. */
+	if (field == info->key_field)
+		return -1;
+	if (info->key_field && field > info->key_field)
+		field--;
+	for (i = 0; i < p->num_parts; i++) {
+		const struct pattern_part *part = &p->part[i];
+
+		if (part->type == LITERAL && part->number_type == LITERAL
+		    && !part->wild)
+			continue;
+		if (--field)
+			continue;
+		if (part->wild)
+			return -1;
+		*type = part->type != LITERAL ? part->type : part->number_type;
+		return i;
+	}
+	return -1;
+}
+
+/* Up to @max more values from @it, as doubles: returns how many. */
+static size_t col_iter_doubles(struct col_iter *it, double *d, size_t max)
+{
+	size_t n = 0;
+
+	while (n < max) {
+		if (it->i == it->num) {
+			it->vals = col_iter_next(it, &it->num);
+			if (!it->vals)
+				break;
+			it->i = 0;
+		}
+		if (it->type == INTEGER)
+			for (; it->i < it->num && n < max; it->i++)
+				d[n++] = it->vals[it->i].ival;
+		else
+			for (; it->i < it->num && n < max; it->i++)
+				d[n++] = it->vals[it->i].dval;
+	}
+	return n;
+}
+
+/* Rows we evaluate a --derive expression over at once. */
+#define DERIVE_CHUNK 256
+
+/*
+ * Fill @out with @d for each row of @l: false if @l lacks its fields,
+ * or no row gives a finite result.  Rows which don't (dividing by zero)
+ * are left out, unless @keep_all (for csv, which prints them empty).
+ */
+static bool derive_line(const struct file *info, const struct line *l,
+			const struct derive *d, struct column *out,
+			bool keep_all)
+{
+	struct col_iter *it = malloc(sizeof(*it) * d->num_ops);
+	double (*stack)[DERIVE_CHUNK] = malloc(sizeof(*stack) * d->depth);
+	size_t i, j, n, sp, row, rows = line_rows(l), finite = 0;
+	bool ok = true;
+
+	for (i = 0; i < d->num_ops; i++) {
+		enum pattern_type type;
+		long off;
+
+		if (d->ops[i].op != DERIVE_FIELD)
+			continue;
+		off = field_part(info, l, d->ops[i].field, &type);
+		if (off < 0) {
+			ok = false;
+			break;
+		}
+		col_iter_init(&it[i], &l->cols[off], type);
+	}
+	if (!ok) {
+		while (i--)
+			if (d->ops[i].op == DERIVE_FIELD)
+				col_iter_done(&it[i]);
+		goto out;
+	}
+
+	for (row = 0; row < rows; row += n) {
+		n = rows - row < DERIVE_CHUNK ? rows - row : DERIVE_CHUNK;
+		for (i = sp = 0; i < d->num_ops; i++) {
+			const struct derive_op *op = &d->ops[i];
+			double *a, *b;
+
+			switch (op->op) {
+			case DERIVE_FIELD:
+				col_iter_doubles(&it[i], stack[sp++], n);
+				continue;
+			case DERIVE_CONST:
+				for (j = 0; j < n; j++)
+					stack[sp][j] = op->val;
+				sp++;
+				continue;
+			case DERIVE_NEG:
+				for (j = 0, b = stack[sp - 1]; j < n; j++)
+					b[j] = -b[j];
+				continue;
+			default:
+				break;
+			}
+			/* The rest replace the top two values with one. */
+			a = stack[sp - 2];
+			b = stack[--sp];
+			switch (op->op) {
+			case DERIVE_ADD:
+				for (j = 0; j < n; j++)
+					a[j] += b[j];
+				break;
+			case DERIVE_SUB:
+				for (j = 0; j < n; j++)
+					a[j] -= b[j];
+				break;
+			case DERIVE_MUL:
+				for (j = 0; j < n; j++)
+					a[j] *= b[j];
+				break;
+			case DERIVE_DIV:
+				for (j = 0; j < n; j++)
+					a[j] /= b[j];
+				break;
+			default:
+				abort();
+			}
+		}
+		for (j = 0; j < n; j++) {
+			if (isfinite(stack[0][j]))
+				finite++;
+			else if (!keep_all)
+				continue;
+			column_add(out, FLOAT, (union val){ .dval = stack[0][j] });
+		}
+	}
+	for (i = 0; i < d->num_ops; i++)
+		if (d->ops[i].op == DERIVE_FIELD)
+			col_iter_done(&it[i]);
+	ok = finite > 0;
+out:
+	free(stack);
+	free(it);
+	return ok;
+}
+
+/* Work out each --derive column of each line, to print. */
+static void derive_lines(struct file *info, bool keep_all)
+{
+	struct line *l;
+	size_t i;
+
+	if (!info->num_derive)
+		return;
+	list_for_each(&info->lines, l, list) {
+		l->derived = malloc(sizeof(*l->derived) * info->num_derive);
+		for (i = 0; i < info->num_derive; i++) {
+			l->derived[i] = new_columns(1);
+			if (!derive_line(info, l, &info->derive[i],
+					 l->derived[i], keep_all)) {
+				free(l->derived[i]);
+				l->derived[i] = NULL;
+			}
+		}
+	}
+}
+
+static void free_derived(struct file *info)
+{
+	struct line *l;
+	size_t i;
+
+	list_for_each(&info->lines, l, list) {
+		if (!l->derived)
+			continue;
+		for (i = 0; i < info->num_derive; i++) {
+			if (l->derived[i])
+				column_free(l->derived[i]);
+			free(l->derived[i]);
+		}
+		free(l->derived);
+		l->derived = NULL;
+	}
+}
+
+/*
+ * With --correlate, each line gets the correlation matrix of its
+ * numeric fields, computed in one pass over its rows: we take them
+ * DERIVE_CHUNK at a time, and fold each chunk's means and co-moments
+ * into the running ones (Chan et al.'s pairwise update), which is
+ * stable, and keeps the inner loops over plain arrays.
+ */
+struct correlation {
+	size_t num;
+	/* Which number (as --fields counts them) each is. */
+	size_t *field;
+	/* num x num; spearman is NULL unless asked for. */
+	double *pearson, *spearman;
+};
+
+struct comoments {
+	size_t k, n;
+	/* The means, the co-moments (upper half), and the chunk's means. */
+	double *mean, *c, *m;
+};
+
+static void comoments_init(struct comoments *cm, size_t k)
+{
+	cm->k = k;
+	cm->n = 0;
+	cm->mean = calloc(k, sizeof(double));
+	cm->c = calloc(k * k, sizeof(double));
+	cm->m = malloc(sizeof(double) * k);
+}
+
+/* Add @nb rows: @x is k arrays of DERIVE_CHUNK (which we overwrite). */
+static void comoments_add(struct comoments *cm, double (*x)[DERIVE_CHUNK],
+			  size_t nb)
+{
+	double *m = cm->m, scale = (double)cm->n * nb / (cm->n + nb);
+	size_t a, b, j;
+
+	for (a = 0; a < cm->k; a++) {
+		double sum = 0;
+
+		for (j = 0; j < nb; j++)
+			sum += x[a][j];
+		m[a] = sum / nb;
+		for (j = 0; j < nb; j++)
+			x[a][j] -= m[a];
+	}
+	for (a = 0; a < cm->k; a++) {
+		for (b = a; b < cm->k; b++) {
+			double sum = 0;
+
+			for (j = 0; j < nb; j++)
+				sum += x[a][j] * x[b][j];
+			cm->c[a * cm->k + b] += sum + (m[a] - cm->mean[a])
+				* (m[b] - cm->mean[b]) * scale;
+		}
+	}
+	for (a = 0; a < cm->k; a++)
+		cm->mean[a] += (m[a] - cm->mean[a]) * nb / (cm->n + nb);
+	cm->n += nb;
+}
+
+/* Turn them into correlations (a full matrix, in @r), and free them. */
+static void comoments_finish(struct comoments *cm, double *r)
+{
+	size_t a, b, k = cm->k;
+
+	for (a = 0; a < k; a++) {
+		r[a * k + a] = 1;
+		for (b = a + 1; b < k; b++)
+			r[a * k + b] = r[b * k + a] = cm->c[a * k + b]
+				/ sqrt(cm->c[a * k + a] * cm->c[b * k + b]);
+	}
+	free(cm->mean);
+	free(cm->c);
+	free(cm->m);
+}
+
+struct ranked {
+	double val;
+	size_t row;
+};
+
+static int cmp_ranked(const void *a, const void *b)
+{
+	const struct ranked *r1 = a, *r2 = b;
+
+	if (r1->val < r2->val)
+		return -1;
+	return r1->val > r2->val;
+}
+
+/* Replace the @n values in @d by their ranks (ties get the average). */
+static void rank_values(double *d, size_t n, struct ranked *r)
+{
+	size_t i, j;
+
+	for (i = 0; i < n; i++) {
+		r[i].val = d[i];
+		r[i].row = i;
+	}
+	qsort(r, n, sizeof(*r), cmp_ranked);
+	for (i = 0; i < n; i = j) {
+		double rank;
+
+		for (j = i + 1; j < n && r[j].val == r[i].val; j++);
+		/* Ranks are from 1: these are i+1 to j. */
+		rank = (i + 1 + j) / 2.0;
+		for (; i < j; i++)
+			d[r[i].row] = rank;
+	}
+}
+
+/* Which number of the line (as --fields counts them) part @off is. */
+static size_t part_field(const struct file *info, const struct line *l,
+			 size_t off)
+{
+	size_t i, field = 0;
+
+	for (i = 0; i <= off; i++) {
+		const struct pattern_part *part = &l->pattern->part[i];
+
+		if (part->type != LITERAL || part->number_type != LITERAL
+		    || part->wild)
+			field++;
+	}
+	if (info->key_field && field >= info->key_field)
+		field++;
+	return field;
+}
+
+static void correlate_line(const struct file *info, struct line *l,
+			   bool spearman)
+{
+	const struct pattern *p = l->pattern;
+	size_t i, k, row, n, rows = line_rows(l);
+	double (*x)[DERIVE_CHUNK], **all = NULL;
+	struct correlation *corr;
+	struct comoments cm;
+	struct col_iter *it;
+
+	for (i = k = 0; i < p->num_parts; i++)
+		if (p->part[i].type != LITERAL)
+			k++;
+	if (k < 2)
+		return;
+
+	corr = malloc(sizeof(*corr));
+	corr->num = k;
+	corr->field = malloc(sizeof(*corr->field) * k);
+	corr->pearson = malloc(sizeof(double) * k * k);
+	corr->spearman = NULL;
+	it = malloc(sizeof(*it) * k);
+	for (i = k = 0; i < p->num_parts; i++) {
+		if (p->part[i].type == LITERAL)
+			continue;
+		corr->field[k] = part_field(info, l, i);
+		col_iter_init(&it[k++], &l->cols[i], p->part[i].type);
+	}
+
+	/* Ranking needs them all: otherwise we only need a chunk. */
+	if (spearman) {
+		all = malloc(sizeof(*all) * k);
+		for (i = 0; i < k; i++) {
+			all[i] = malloc(sizeof(double) * rows);
+			col_iter_doubles(&it[i], all[i], rows);
+		}
+	}
+
+	x = malloc(sizeof(*x) * k);
+	comoments_init(&cm, k);
+	for (row = 0; row < rows; row += n) {
+		n = rows - row < DERIVE_CHUNK ? rows - row : DERIVE_CHUNK;
+		for (i = 0; i < k; i++) {
+			if (all)
+				memcpy(x[i], all[i] + row, sizeof(double) * n);
+			else
+				col_iter_doubles(&it[i], x[i], n);
+		}
+		comoments_add(&cm, x, n);
+	}
+	comoments_finish(&cm, corr->pearson);
+
+	if (all) {
+		struct ranked *r = malloc(sizeof(*r) * rows);
+
+		for (i = 0; i < k; i++)
+			rank_values(all[i], rows, r);
+		free(r);
+		corr->spearman = malloc(sizeof(double) * k * k);
+		comoments_init(&cm, k);
+		for (row = 0; row < rows; row += n) {
+			n = rows - row < DERIVE_CHUNK ? rows - row : DERIVE_CHUNK;
+			for (i = 0; i < k; i++)
+				memcpy(x[i], all[i] + row, sizeof(double) * n);
+			comoments_add(&cm, x, n);
+		}
+		comoments_finish(&cm, corr->spearman);
+		for (i = 0; i < k; i++)
+			free(all[i]);
+		free(all);
+	}
+	for (i = 0; i < k; i++)
+		col_iter_done(&it[i]);
+	free(it);
+	free(x);
+	l->corr = corr;
+}
+
+/* Lines are independent, so threads take the next one as they finish. */
+struct correlate_job {
+	const struct file *info;
+	struct line **lines;
+	size_t num, next;
+	bool spearman;
+};
+
+static void *correlate_thread(void *arg)
+{
+	struct correlate_job *job = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+	       < job->num)
+		correlate_line(job->info, job->lines[i], job->spearman);
+	return NULL;
+}
+
+static void correlate_lines(struct file *info, unsigned threads,
+			    bool spearman)
+{
+	struct correlate_job job;
+	pthread_t *tids;
+	struct line *l;
+	size_t i;
+
+	job.info = info;
+	job.lines = NULL;
+	job.num = job.next = 0;
+	job.spearman = spearman;
+	list_for_each(&info->lines, l, list) {
+		job.lines = realloc(job.lines,
+				    sizeof(*job.lines) * (job.num + 1));
+		job.lines[job.num++] = l;
+	}
+	if (threads > job.num)
+		threads = job.num;
+	tids = malloc(sizeof(*tids) * threads);
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, correlate_thread, &job) != 0)
+			err(1, "Creating correlation thread");
+	correlate_thread(&job);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	free(job.lines);
+}
+
+static void free_correlations(struct file *info)
+{
+	struct line *l;
+
+	list_for_each(&info->lines, l, list) {
+		if (!l->corr)
+			continue;
+		free(l->corr->field);
+		free(l->corr->pearson);
+		free(l->corr->spearman);
+		free(l->corr);
+		l->corr = NULL;
+	}
+}
+
+static void print_matrix(FILE *out, const char *name,
+			 const struct correlation *corr, const double *r)
+{
+	size_t a, b;
+	char label[32];
+
+	fprintf(out, "  %-8s", name);
+	for (b = 0; b < corr->num; b++) {
+		sprintf(label, "[%zu]", corr->field[b]);
+		fprintf(out, " %7s", label);
+	}
+	fputc('\n', out);
+	for (a = 0; a < corr->num; a++) {
+		sprintf(label, "[%zu]", corr->field[a]);
+		fprintf(out, "  %8s", label);
+		for (b = 0; b < corr->num; b++)
+			fprintf(out, " %7.3f", r[a * corr->num + b]);
+		fputc('\n', out);
+	}
+}
+
+/*
+ * With --ess, the effective sample size of each field, allowing for
+ * each value being correlated with the ones before, and the standard
+ * error of the mean which goes with it.  We use non-overlapping batch
+ * means: the variance of the means of sqrt(n) batches of sqrt(n)
+ * consecutive values estimates the variance the mean really has.
+ * That's one pass, without keeping anything.
+ */
+struct ess {
+	double ess, sem;
+};
+
+/* Welford's running mean and variance. */
+struct running {
+	size_t n;
+	double mean, m2;
+};
+
+static void running_add(struct running *r, double d)
+{
+	double delta = d - r->mean;
+
+	r->n++;
+	r->mean += delta / r->n;
+	r->m2 += delta * (d - r->mean);
+}
+
+static double running_var(const struct running *r)
+{
+	return r->m2 / (r->n - 1);
+}
+
+/* False if there are too few values (or they're only a sample). */
+static bool get_ess(const struct line *l, size_t off, struct ess *e)
+{
+	struct running vals = { 0, 0, 0 }, batches = { 0, 0, 0 };
+	size_t b, n = line_rows(l);
+	struct col_iter it;
+	double sum = 0, var;
+	union val v;
+
+	if (l->sample || n < 4)
+		return false;
+	b = sqrt(n);
+	col_iter_init(&it, &l->cols[off], l->pattern->part[off].type);
+	while (batches.n < n / b && col_iter_val(&it, &v)) {
+		double d = it.type == INTEGER ? v.ival : v.dval;
+
+		running_add(&vals, d);
+		sum += d;
+		if (vals.n % b == 0) {
+			running_add(&batches, sum / b);
+			sum = 0;
+		}
+	}
+	col_iter_done(&it);
+	if (batches.n < 2)
+		return false;
+
+	/*
+	 * What n independent values would need to vary this much.  If the
+	 * batch means vary less than that (anti-correlated values, like
+	 * 1 2 1 2...), we don't claim better than independent values.
+	 */
+	var = running_var(&batches) * b;
+	if (var < running_var(&vals))
+		var = running_var(&vals);
+	e->ess = var ? n * running_var(&vals) / var : n;
+	e->sem = sqrt(var / n);
+	return true;
+}
+
+static bool suppress(const struct line *l, bool suppress_inv)
+{
+	size_t i;
+
+	if (!suppress_inv)
+		return false;
+
+	for (i = 0; i < l->pattern->num_parts; i++)
+		if (l->pattern->part[i].type != LITERAL)
+			return false;
+
+	/* All literals, so this line is invariant. */
+	return true;
+}
+
+static void print_derived(FILE *out, const struct file *info,
+			  const struct line *l, size_t i, bool trim_out)
+{
+	struct val_stats st;
+
+	get_derived_stats(l->derived[i], trim_out, &st);
+	fprintf(out, "  %s=", info->derive[i].name);
+	print_summary(out, &st, &double_ops);
+}
+
+static void print_ess(FILE *out, const struct file *info,
+		      const struct line *l)
+{
+	struct ess e;
+	size_t i;
+
+	for (i = 0; i < l->pattern->num_parts; i++) {
+		if (l->pattern->part[i].type == LITERAL || !get_ess(l, i, &e))
+			continue;
+		fprintf(out, "  [%zu] ess %.1f of %zu, mean +/- %.3g\n",
+			part_field(info, l, i), e.ess, line_rows(l), e.sem);
+	}
+}
+
+static void print_analysis(FILE *out, const struct file *info,
+			   bool trim_outliers, bool show_count, bool suppress_inv,
+			   bool ess)
+{
+	struct line *l;
+
+	list_for_each(&info->lines, l, list) {
+		size_t i;
+
+		if (suppress(l, suppress_inv))
+			continue;
+
+		for (i = 0; i < l->pattern->num_parts; i++) {
+			if (l->pattern->part[i].type == LITERAL)
+				print_literal_part(out, l->pattern, i);
+			else
+				print_val(out, l, i, trim_outliers);
+		}
+		for (i = 0; i < info->num_derive; i++)
+			if (l->derived[i])
+				print_derived(out, info, l, i, trim_outliers);
+
+		if (show_count) {
+			fprintf(out, "  (%lli)", l->count);
+		}
+		fputc('\n', out);
+		if (ess)
+			print_ess(out, info, l);
+		if (l->corr) {
+			print_matrix(out, "pearson", l->corr, l->corr->pearson);
+			if (l->corr->spearman)
+				print_matrix(out, "spearman", l->corr,
+					     l->corr->spearman);
+		}
+	}
+	if (info->other_count)
+		fprintf(out, "[other]  (%lli)\n", info->other_count);
+}
+
+static void print_literal_noquote(FILE *out, const struct pattern *p,
+				  size_t off)
+{
+	size_t i;
+
+	if (p->part[off].wild) {
+		print_wild(out, p, off);
+		return;
+	}
+	for (i = p->part[off].off; i < p->part[off].off + p->part[off].len; i++)
+		if (p->text[i] != '"')
+			fputc(p->text[i], out);
+}
+
+static void print_graph(FILE *out, const struct column *col,
+			enum pattern_type type)
+{
+	struct tally *tally = tally_new(10000);
+	struct col_iter it;
+	union val v;
+	char *graph;
+
+	if (type == FLOAT) {
+		double min = DBL_MAX, max = DBL_MIN, scale;
+
+		/* Tally does integers, so we need to normalize to percentages. */
+		col_iter_init(&it, col, type);
+		while (col_iter_val(&it, &v)) {
+			if (v.dval > max)
+				max = v.dval;
+			if (v.dval < min)
+				min = v.dval;
+		}
+		col_iter_done(&it);
+		fprintf(out, " (%f-%f, graphed as percentiles)\n", min, max);
+		scale = (max - min) / 100;
+
+		col_iter_init(&it, col, type);
+		while (col_iter_val(&it, &v))
+			tally_add(tally, (v.dval - min) / scale);
+		col_iter_done(&it);
+	} else {
+		assert(type == INTEGER);
+		fputc('\n', out);
+		col_iter_init(&it, col, type);
+		while (col_iter_val(&it, &v))
+			tally_add(tally, v.ival);
+		col_iter_done(&it);
+	}
+	graph = tally_histogram(tally, 78, 25);
+	fprintf(out, "%s", graph);
+	free(graph);
+	free(tally);
+}
+
+static void print_histograms(FILE *out, const struct file *info,
+			     bool trim_outliers, bool suppress_inv)
+{
+	struct line *l;
+	size_t i;
+	bool first_line = true, printed_graph, printed_literal;
+
+	list_for_each(&info->lines, l, list) {
+		if (suppress(l, suppress_inv))
+			continue;
+
+		if (!first_line)
+			fputc('\n', out);
+		first_line = false;
+		printed_graph = false;
+		printed_literal = false;
+
+		for (i = 0; i < l->pattern->num_parts; i++) {
+			if (printed_graph)
+				fprintf(out, "\n...");
+			if (l->pattern->part[i].type == LITERAL) {
+				print_literal_part(out, l->pattern, i);
+				printed_graph = false;
+				printed_literal = true;
+			} else {
+				fprintf(out, "%s[GRAPH]:", (printed_literal ? " " : ""));
+				print_graph(out, &l->cols[i], l->pattern->part[i].type);
+				printed_graph = true;
+				printed_literal = false;
+			}
+		}
+		for (i = 0; i < info->num_derive; i++) {
+			if (!l->derived[i])
+				continue;
+			fprintf(out, "%s  %s=[GRAPH]:", printed_graph ? "\n..." : "",
+				info->derive[i].name);
+			print_graph(out, l->derived[i], FLOAT);
+			printed_graph = true;
+		}
+	}
+}
+
+static void print_csv(FILE *out, const struct file *info, bool show_count,
+		      bool suppress_inv)
+{
+	struct line *l;
+	size_t i, num = 1;
+	bool first_line = true;
+
+	list_for_each(&info->lines, l, list) {
+		struct col_iter *it;
+		size_t row;
+
+		if (suppress(l, suppress_inv))
+			continue;
+
+		if (!first_line)
+			fputc('\n', out);
+		first_line = false;
+
+		/* First print the header */
+		fputc('"', out);
+		for (i = 0; i < l->pattern->num_parts; i++) {
+			if (l->pattern->part[i].type == LITERAL)
+				print_literal_noquote(out, l->pattern, i);
+			else
+				fprintf(out, "%s[%zu]%s",
+					(i > 0 ? " " : ""), num++,
+					unit_names[l->pattern->part[i].unit]);
+		}
+		for (i = 0; i < info->num_derive; i++)
+			if (l->derived[i])
+				fprintf(out, " [%s]", info->derive[i].name);
+		fputc('"', out);
+		if (show_count) {
+			fprintf(out, "  (%lli)", l->count);
+		}
+		fputc('\n', out);
+
+		/* Now print values, reading each column in step. */
+		it = malloc(sizeof(*it) * (l->pattern->num_parts
+					   + info->num_derive));
+		for (i = 0; i < l->pattern->num_parts; i++)
+			col_iter_init(&it[i], &l->cols[i],
+				      l->pattern->part[i].type);
+		for (i = 0; i < info->num_derive; i++)
+			if (l->derived[i])
+				col_iter_init(&it[l->pattern->num_parts + i],
+					      l->derived[i], FLOAT);
+		for (row = 0; row < line_rows(l); row++) {
+			bool printed = false;
+			for (i = 0; i < l->pattern->num_parts; i++) {
+				union val v;
+
+				switch (l->pattern->part[i].type) {
+				case FLOAT:
+					if (printed)
+						fputc(',', out);
+					col_iter_val(&it[i], &v);
+					print_double(out, v);
+					printed = true;
+					break;
+				case INTEGER:
+					if (printed)
+						fputc(',', out);
+					col_iter_val(&it[i], &v);
+					print_int(out, v);
+					printed = true;
+					break;
+				default:
+					break;
+				}
+			}
+			for (i = 0; i < info->num_derive; i++) {
+				union val v;
+
+				if (!l->derived[i])
+					continue;
+				if (printed)
+					fputc(',', out);
+				col_iter_val(&it[l->pattern->num_parts + i], &v);
+				if (isfinite(v.dval))
+					print_double(out, v);
+				printed = true;
+			}
+			if (!printed)
+				break;
+			fputc('\n', out);
+		}
+		for (i = 0; i < l->pattern->num_parts; i++)
+			col_iter_done(&it[i]);
+		for (i = 0; i < info->num_derive; i++)
+			if (l->derived[i])
+				col_iter_done(&it[l->pattern->num_parts + i]);
+		free(it);
+	}
+	if (info->other_count) {
+		if (!first_line)
+			fputc('\n', out);
+		fprintf(out, "\"[other]\"  (%lli)\n", info->other_count);
+	}
+}
+
+/* Minimal streaming JSON writer: no tree, just enough state for commas. */
+#define JSON_MAX_DEPTH 8
+
+struct json {
+	FILE *out;
+	unsigned int depth;
+	bool after_key;
+	bool need_comma[JSON_MAX_DEPTH];
+};
+
+static void json_init(struct json *j, FILE *out)
+{
+	j->out = out;
+	j->depth = 0;
+	j->after_key = false;
+	j->need_comma[0] = false;
+}
+
+/* Every value is either preceded by a key, or separated by a comma. */
+static void json_value_start(struct json *j)
+{
+	if (j->after_key)
+		j->after_key = false;
+	else if (j->need_comma[j->depth])
+		fputc(',', j->out);
+	j->need_comma[j->depth] = true;
+}
+
+static void json_escape(struct json *j, const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(j->out, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", j->out);
+		else if (c == '\t')
+			fputs("\\t", j->out);
+		else if (c < 0x20)
+			fprintf(j->out, "\\u%04x", c);
+		else
+			fputc(c, j->out);
+	}
+}
+
+static void json_raw_string(struct json *j, const char *str, size_t len)
+{
+	fputc('"', j->out);
+	json_escape(j, str, len);
+	fputc('"', j->out);
+}
+
+static void json_string(struct json *j, const char *str)
+{
+	json_value_start(j);
+	json_raw_string(j, str, strlen(str));
+}
+
+static void json_key(struct json *j, const char *key)
+{
+	json_value_start(j);
+	json_raw_string(j, key, strlen(key));
+	fputc(':', j->out);
+	j->after_key = true;
+}
+
+static void json_open(struct json *j, char c)
+{
+	json_value_start(j);
+	fputc(c, j->out);
+	assert(j->depth + 1 < JSON_MAX_DEPTH);
+	j->need_comma[++j->depth] = false;
+}
+
+static void json_close(struct json *j, char c)
+{
+	assert(j->depth > 0);
+	j->depth--;
+	fputc(c, j->out);
+}
+
+static void json_bool(struct json *j, bool v)
+{
+	json_value_start(j);
+	fputs(v ? "true" : "false", j->out);
+}
+
+static void json_int(struct json *j, long long v)
+{
+	json_value_start(j);
+	fprintf(j->out, "%lli", v);
+}
+
+static void json_double(struct json *j, double d)
+{
+	json_value_start(j);
+	/* JSON has no representation for these. */
+	if (isnan(d) || isinf(d)) {
+		fputs("null", j->out);
+	} else {
+		char buf[32];
+
+		/* Shortest of these which reads back as the same double. */
+		snprintf(buf, sizeof(buf), "%.15g", d);
+		if (strtod(buf, NULL) != d)
+			snprintf(buf, sizeof(buf), "%.17g", d);
+		fputs(buf, j->out);
+	}
+}
+
+static void json_val(struct json *j, union val v, enum pattern_type type)
+{
+	if (type == INTEGER)
+		json_int(j, v.ival);
+	else
+		json_double(j, v.dval);
+}
+
+/* Requested percentiles, as 0-100. */
+struct percentiles {
+	size_t num;
+	double *pct;
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double *d1 = a, *d2 = b;
+
+	if (*d1 < *d2)
+		return -1;
+	return *d1 > *d2;
+}
+
+/* Linear interpolation between closest ranks of sorted values. */
+static double percentile(const double *sorted, size_t num, double pct)
+{
+	double rank = pct / 100 * (num - 1);
+	size_t lo = rank;
+
+	if (lo + 1 >= num)
+		return sorted[num - 1];
+	return sorted[lo] + (rank - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+/* Doubles as unsigned integers which sort in the same order. */
+static uint64_t double_key(double d)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &d, sizeof(bits));
+	return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+static double key_double(uint64_t key)
+{
+	uint64_t bits = (key >> 63) ? key & ~(1ULL << 63) : ~key;
+	double d;
+
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+/*
+ * The @k'th smallest value (from 0), without holding them all: each
+ * pass over the column counts values sharing the key bits found so
+ * far, to find the next 16 bits.
+ */
+static double select_val(const struct column *col, enum pattern_type type,
+			 const struct val_ops *ops, size_t k)
+{
+	size_t *count = malloc(sizeof(*count) << 16);
+	uint64_t key = 0, mask = 0;
+	int shift;
+
+	for (shift = 48; shift >= 0; shift -= 16) {
+		struct col_iter it;
+		union val v;
+		size_t b;
+
+		memset(count, 0, sizeof(*count) << 16);
+		col_iter_init(&it, col, type);
+		while (col_iter_val(&it, &v)) {
+			uint64_t vkey = double_key(ops->to_double(v));
+
+			if ((vkey & mask) == key)
+				count[(vkey >> shift) & 0xFFFF]++;
+		}
+		col_iter_done(&it);
+
+		for (b = 0; k >= count[b]; b++)
+			k -= count[b];
+		key |= (uint64_t)b << shift;
+		mask |= 0xFFFFULL << shift;
+	}
+	free(count);
+	return key_double(key);
+}
+
+/* percentile(), for a column too big to sort in memory. */
+static double percentile_select(const struct column *col,
+				enum pattern_type type,
+				const struct val_ops *ops,
+				size_t num, double pct)
+{
+	double rank = pct / 100 * (num - 1), lo_val;
+	size_t lo = rank;
+
+	if (lo + 1 >= num)
+		return select_val(col, type, ops, num - 1);
+	lo_val = select_val(col, type, ops, lo);
+	return lo_val + (rank - lo) * (select_val(col, type, ops, lo + 1)
+				       - lo_val);
+}
+
+static void json_percentiles(struct json *j, const struct column *col,
+			     enum pattern_type type, size_t num,
+			     const struct val_ops *ops,
+			     const struct percentiles *pcts)
+{
+	double *sorted = NULL;
+	size_t i = 0;
+
+	/* Sorting needs a copy of every value: too much for --max-memory? */
+	if (!spill.max || num * sizeof(*sorted) <= spill.max / 2) {
+		struct col_iter it;
+		union val v;
+
+		sorted = malloc(sizeof(*sorted) * num);
+		col_iter_init(&it, col, type);
+		while (col_iter_val(&it, &v))
+			sorted[i++] = ops->to_double(v);
+		col_iter_done(&it);
+		qsort(sorted, num, sizeof(*sorted), cmp_double);
+	}
+
+	json_key(j, "percentiles");
+	json_open(j, '{');
+	for (i = 0; i < pcts->num; i++) {
+		char key[32];
+
+		snprintf(key, sizeof(key), "%g", pcts->pct[i]);
+		json_key(j, key);
+		if (sorted)
+			json_double(j, percentile(sorted, num, pcts->pct[i]));
+		else
+			json_double(j, percentile_select(col, type, ops, num,
+							 pcts->pct[i]));
+	}
+	json_close(j, '}');
+	free(sorted);
+}
+
+/* The line as the text output would show it, with [n] for each field. */
+static void json_template(struct json *j, const struct pattern *p)
+{
+	size_t i, num = 1;
+
+	json_value_start(j);
+	fputc('"', j->out);
+	for (i = 0; i < p->num_parts; i++) {
+		if (p->part[i].wild)
+			print_wild(j->out, p, i);
+		else if (p->part[i].type == LITERAL)
+			json_escape(j, p->text + p->part[i].off,
+				    p->part[i].len);
+		else
+			fprintf(j->out, "%s[%zu]",
+				spacestart(p, i) ? " " : "", num++);
+	}
+	fputc('"', j->out);
+}
+
+static void json_field(struct json *j, const struct column *col,
+		       enum pattern_type type, enum unit unit,
+		       const struct val_stats *st, size_t rows,
+		       const struct val_ops *ops, const struct percentiles *pcts,
+		       const struct ess *e)
+{
+	json_open(j, '{');
+	json_key(j, "type");
+	json_string(j, type == INTEGER ? "integer" : "float");
+	if (unit) {
+		json_key(j, "unit");
+		json_string(j, unit_names[unit]);
+	}
+	json_key(j, "min");
+	json_val(j, st->min, type);
+	json_key(j, "max");
+	json_val(j, st->max, type);
+	json_key(j, "mean");
+	json_double(j, st->avg);
+	json_key(j, "stddev");
+	json_double(j, st->stddev);
+	if (pcts->num)
+		json_percentiles(j, col, type, rows, ops, pcts);
+	if (e) {
+		json_key(j, "ess");
+		json_double(j, e->ess);
+		json_key(j, "sem");
+		json_double(j, e->sem);
+	}
+	json_close(j, '}');
+}
+
+static void json_matrix(struct json *j, size_t k, const double *r)
+{
+	size_t a, b;
+
+	json_open(j, '[');
+	for (a = 0; a < k; a++) {
+		json_open(j, '[');
+		for (b = 0; b < k; b++)
+			json_double(j, r[a * k + b]);
+		json_close(j, ']');
+	}
+	json_close(j, ']');
+}
+
+static void print_json(FILE *out, const struct file *info, bool trim_outliers,
+		       bool suppress_inv, const struct percentiles *pcts,
+		       bool ess)
+{
+	struct line *l;
+	struct json j;
+
+	json_init(&j, out);
+	list_for_each(&info->lines, l, list) {
+		size_t i;
+
+		if (suppress(l, suppress_inv))
+			continue;
+
+		/* One object per line, so it can be streamed as NDJSON. */
+		json_open(&j, '{');
+		json_key(&j, "template");
+		json_template(&j, l->pattern);
+		json_key(&j, "count");
+		json_int(&j, l->count);
+		json_key(&j, "fields");
+		json_open(&j, '[');
+		for (i = 0; i < l->pattern->num_parts; i++) {
+			const struct val_ops *ops;
+			struct val_stats st;
+			enum pattern_type type = l->pattern->part[i].type;
+			struct ess e;
+
+			if (type == LITERAL)
+				continue;
+
+			ops = part_ops(l->pattern, i);
+			get_val_stats(l, i, trim_outliers, ops, &st);
+			json_field(&j, &l->cols[i], type, l->pattern->part[i].unit,
+				   &st, line_rows(l), ops, pcts,
+				   ess && get_ess(l, i, &e) ? &e : NULL);
+		}
+		json_close(&j, ']');
+		if (l->corr) {
+			json_key(&j, "correlation");
+			json_open(&j, '{');
+			json_key(&j, "fields");
+			json_open(&j, '[');
+			for (i = 0; i < l->corr->num; i++)
+				json_int(&j, l->corr->field[i]);
+			json_close(&j, ']');
+			json_key(&j, "pearson");
+			json_matrix(&j, l->corr->num, l->corr->pearson);
+			if (l->corr->spearman) {
+				json_key(&j, "spearman");
+				json_matrix(&j, l->corr->num,
+					    l->corr->spearman);
+			}
+			json_close(&j, '}');
+		}
+		for (i = 0; i < info->num_derive; i++)
+			if (l->derived[i])
+				break;
+		if (i < info->num_derive) {
+			json_key(&j, "derived");
+			json_open(&j, '{');
+			for (i = 0; i < info->num_derive; i++) {
+				struct val_stats st;
+
+				if (!l->derived[i])
+					continue;
+				get_derived_stats(l->derived[i], trim_outliers,
+						  &st);
+				json_key(&j, info->derive[i].name);
+				json_field(&j, l->derived[i], FLOAT, UNIT_NONE,
+					   &st, st.num, &double_ops, pcts, NULL);
+			}
+			json_close(&j, '}');
+		}
+		json_close(&j, '}');
+		fputc('\n', out);
+		/* Next object is a fresh top-level value. */
+		j.need_comma[0] = false;
+	}
+	if (info->other_count) {
+		json_open(&j, '{');
+		json_key(&j, "other");
+		json_bool(&j, true);
+		json_key(&j, "count");
+		json_int(&j, info->other_count);
+		json_close(&j, '}');
+		fputc('\n', out);
+	}
+}
+
+static void free_file_info(struct file *info)
+{
+	struct line *l;
+	size_t i;
+
+	while ((l = list_pop(&info->lines, struct line, list)) != NULL) {
+		for (i = 0; i < l->pattern->num_parts; i++)
+			column_free(&l->cols[i]);
+		free(l->cols);
+		free_sample(l->sample);
+		free((char *)l->pattern->text);
+		free(l->pattern);
+		free(l);
+	}
+	free(info->heap);
+	free(info->fields);
+	free(info->match.n);
+	free(info->exclude.n);
+	for (i = 0; i < info->num_derive; i++) {
+		free(info->derive[i].name);
+		free(info->derive[i].ops);
+	}
+	free(info->derive);
+	free(info->match_vals);
+	free(info->match_types);
+
+	for (i = 0; i < LINE_SHARDS; i++) {
+		linehash_clear(&info->shard[i].patterns);
+		pthread_mutex_destroy(&info->shard[i].lock);
+	}
+}
+
+/* A line stats_add_values() adds to, and where it went last time. */
+struct template {
+	struct pattern *pattern;
+	size_t hash;
+	struct line *line;
+};
+
+struct stats {
+	struct stats_config config;
+	struct percentiles pcts;
+	unsigned *fields;
+	char **match, **exclude, **derive;
+	struct file info;
+	struct template *tmpl;
+	size_t num_tmpl;
+};
+
+static char **copy_strings(const char *const *strs, size_t num)
+{
+	char **copy = malloc(sizeof(*copy) * (num + 1));
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		copy[i] = strdup(strs[i]);
+	return copy;
+}
+
+static void free_strings(char **strs, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		free(strs[i]);
+	free(strs);
+}
+
+struct stats *stats_new(const struct stats_config *config)
+{
+	static const struct stats_config defaults;
+	struct stats *s = malloc(sizeof(*s));
+
+	s->config = config ? *config : defaults;
+	s->pcts.num = s->config.num_percentiles;
+	s->pcts.pct = malloc(sizeof(s->pcts.pct[0]) * (s->pcts.num + 1));
+	if (s->pcts.num)
+		memcpy(s->pcts.pct, s->config.percentiles,
+		       sizeof(s->pcts.pct[0]) * s->pcts.num);
+	s->config.percentiles = s->pcts.pct;
+	s->fields = malloc(sizeof(s->fields[0]) * (s->config.num_fields + 1));
+	if (s->config.num_fields)
+		memcpy(s->fields, s->config.fields,
+		       sizeof(s->fields[0]) * s->config.num_fields);
+	s->config.fields = s->fields;
+	s->match = copy_strings(s->config.match, s->config.num_match);
+	s->config.match = (const char *const *)s->match;
+	s->exclude = copy_strings(s->config.exclude, s->config.num_exclude);
+	s->config.exclude = (const char *const *)s->exclude;
+	s->derive = copy_strings(s->config.derive, s->config.num_derive);
+	s->config.derive = (const char *const *)s->derive;
+	file_init(&s->info, &s->config);
+	s->tmpl = NULL;
+	s->num_tmpl = 0;
+	return s;
+}
+
+const char *stats_check_derive(const char *def, size_t num_prev,
+			       const char *const *prev)
+{
+	struct derive d, p;
+	const char *error = derive_compile(&d, def);
+	size_t i;
+
+	for (i = 0; !error && i < num_prev; i++) {
+		if (!derive_compile(&p, prev[i]) && streq(p.name, d.name))
+			error = "that name is already derived";
+		free(p.name);
+		free(p.ops);
+	}
+	free(d.name);
+	free(d.ops);
+	return error;
+}
+
+void stats_set_memory(size_t max, bool compress)
+{
+	spill.max = max;
+	spill.compress = compress;
+}
+
+void stats_set_profile(bool enable)
+{
+	uint64_t start;
+	size_t i;
+
+	if (prof.hw_enabled)
+		for (i = 0; i < NUM_HW_EVENTS; i++)
+			if (prof.hw_fd[i] >= 0)
+				close(prof.hw_fd[i]);
+	memset(&prof, 0, sizeof(prof));
+	start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	for (i = 0; i < 1000; i++)
+		clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	prof.clock_cost = (clock_ns(CLOCK_THREAD_CPUTIME_ID) - start) / 1001;
+	prof.enabled = enable;
+	prof.start = clock_ns(CLOCK_MONOTONIC);
+	prof.cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void stats_set_perf_counters(bool enable)
+{
+	stats_set_profile(enable);
+	if (enable) {
+		hw_open();
+		prof.hw_enabled = true;
+	}
+}
+
+/* Totals for each phase, and IPC and misses per line. */
+static void print_hw_profile(FILE *out)
+{
+	uint64_t lines = prof.count[COUNT_LINES];
+	size_t i, e;
+
+	fprintf(out, "\n%-24s %12s %12s %8s", "phase", "cycles",
+		"instructions", "IPC");
+	for (e = HW_BRANCH_MISSES; e < NUM_HW_EVENTS; e++)
+		fprintf(out, " %14s", hw_event_names[e]);
+	fprintf(out, "\n");
+	for (i = 0; i < NUM_PHASES; i++) {
+		const uint64_t *hw = prof.hw[i];
+
+		/* The per-line phases are too short to read counters. */
+		if (phase_names[i][0] == ' ')
+			continue;
+		fprintf(out, "%-24s", phase_names[i]);
+		for (e = HW_CYCLES; e <= HW_INSTRUCTIONS; e++) {
+			if (prof.hw_fd[e] < 0)
+				fprintf(out, " %12s", "-");
+			else
+				fprintf(out, " %12llu",
+					(unsigned long long)hw[e]);
+		}
+		if (prof.hw_fd[HW_CYCLES] < 0
+		    || prof.hw_fd[HW_INSTRUCTIONS] < 0 || !hw[HW_CYCLES])
+			fprintf(out, " %8s", "-");
+		else
+			fprintf(out, " %8.2f",
+				(double)hw[HW_INSTRUCTIONS] / hw[HW_CYCLES]);
+		/* Misses per input line. */
+		for (e = HW_BRANCH_MISSES; e < NUM_HW_EVENTS; e++) {
+			if (prof.hw_fd[e] < 0 || !lines)
+				fprintf(out, " %14s", "-");
+			else
+				fprintf(out, " %9.3f/line",
+					(double)hw[e] / lines);
+		}
+		fprintf(out, "\n");
+	}
+	for (e = 0; e < NUM_HW_EVENTS; e++)
+		if (prof.hw_fd[e] < 0)
+			fprintf(out, "%s: unavailable (%s)\n",
+				hw_event_names[e], strerror(prof.hw_errno[e]));
+}
+
+void stats_print_profile(FILE *out)
+{
+	struct rusage ru;
+	uint64_t sampled = 0;
+	double scale = 1;
+	size_t i;
+
+	/* The indented ones are sampled CPU time, see PROF_SAMPLE. */
+	for (i = 0; i < NUM_PHASES; i++)
+		if (phase_names[i][0] == ' ')
+			sampled += prof.cpu[i];
+	if (sampled > prof.cpu[PHASE_INGEST])
+		scale = (double)prof.cpu[PHASE_INGEST] / sampled;
+
+	fprintf(out, "%-24s %12s %12s\n", "phase", "wall(s)", "cpu(s)");
+	for (i = 0; i < NUM_PHASES; i++) {
+		if (phase_names[i][0] == ' ')
+			fprintf(out, "%-24s %12s %12.6f\n", phase_names[i],
+				"(estimate)", prof.cpu[i] * scale / 1e9);
+		else
+			fprintf(out, "%-24s %12.6f %12.6f\n", phase_names[i],
+				prof.wall[i] / 1e9, prof.cpu[i] / 1e9);
+	}
+	fprintf(out, "%-24s %12.6f %12.6f\n", "total",
+		(clock_ns(CLOCK_MONOTONIC) - prof.start) / 1e9,
+		(clock_ns(CLOCK_PROCESS_CPUTIME_ID) - prof.cpu_start) / 1e9);
+	for (i = 0; i < NUM_COUNTERS; i++)
+		fprintf(out, "%-24s %12llu\n", counter_names[i],
+			(unsigned long long)prof.count[i]);
+	/* As most when we printed (what we held as we finished input). */
+	fprintf(out, "%-24s %12zu\n", "value bytes retained",
+		prof.value_bytes);
+#if HAVE_MALLINFO2
+	fprintf(out, "%-24s %12zu\n", "heap bytes retained", prof.heap_bytes);
+#endif
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		fprintf(out, "%-24s %12ld\n", "peak rss (KiB)", ru.ru_maxrss);
+	if (prof.hw_enabled)
+		print_hw_profile(out);
+}
+
+void stats_add_line(struct stats *s, const char *line)
+{
+	add_line(&s->info, s->config.skip, line);
+}
+
+static ssize_t rbuf_input_read(void *in, void *buf, size_t len)
+{
+	ssize_t r = input_read(in, buf, len);
+
+	if (r > 0)
+		prof_count(COUNT_BYTES, r);
+	return r;
+}
+
+int stats_read(struct stats *s, const char *name, const char **what)
+{
+	const struct stats_config *config = &s->config;
+	struct input in;
+	struct rbuf rbuf;
+	char *str;
+	int errnum;
+	unsigned flags = config->io_uring ? INPUT_URING : 0;
+	size_t size = READ_BUFFER_SIZE;
+	struct prof_span span;
+	uint64_t start;
+
+	prof_begin(&span);
+	if (name ? !input_open(&in, name, flags)
+	    : !input_init(&in, STDIN_FILENO, flags)) {
+		*what = "Failed opening";
+		return errno;
+	}
+
+	if (config->threads) {
+		read_pipelined(&s->info, &in, config->skip, config->threads,
+			       config->read_buffer_max);
+	} else {
+		if (config->read_buffer_max && size > config->read_buffer_max)
+			size = config->read_buffer_max;
+		str = resize_buffer(NULL, size);
+		if (!str)
+			err(1, "Allocating %zu byte read buffer", size);
+		rbuf_init(&rbuf, in.fd, str, size);
+		rbuf_set_readfn(&rbuf, rbuf_input_read, &in);
+		rbuf_set_max(&rbuf, config->read_buffer_max);
+		start = prof_start();
+		while ((str = rbuf_read_str(&rbuf, '\n', resize_buffer))) {
+			prof_next(PHASE_READ, start);
+			add_line(&s->info, config->skip, str);
+			start = prof_start();
+		}
+		errnum = errno;
+		prof_count(COUNT_BUF_COPIED, rbuf.bytes_copied);
+		prof_count(COUNT_BUF_GROWS, rbuf.grows);
+		free(rbuf.buf);
+		errno = errnum;
+	}
+	errnum = errno;
+	input_close(&in);
+	finish_lines(&s->info);
+	prof_finish(PHASE_INGEST, &span);
+
+	*what = "Reading";
+	return errnum;
+}
+
+long stats_template(struct stats *s, const char *example)
+{
+	struct template *t;
+	struct pattern *p;
+	union val *vals;
+	size_t i;
+
+	p = get_pattern(example, s->config.skip, &s->info, &vals);
+	free(vals);
+	for (i = 0; i < p->num_parts; i++)
+		if (p->part[i].type != LITERAL)
+			break;
+	if (i == p->num_parts) {
+		free(p);
+		return -1;
+	}
+
+	p->text = strdup(p->text);
+	s->tmpl = realloc(s->tmpl, sizeof(*s->tmpl) * (s->num_tmpl + 1));
+	t = &s->tmpl[s->num_tmpl];
+	t->pattern = p;
+	t->hash = pattern_hash(p);
+	t->line = NULL;
+	return s->num_tmpl++;
+}
+
+/*
+ * The pattern of the line those values would have come from: a new
+ * line keeps its first text, to print numbers which never change.
+ */
+static struct pattern *fill_template(const struct pattern *tp,
+				     const enum pattern_type *types,
+				     const union val *vals)
+{
+	struct pattern *p = malloc(partsize(tp->num_parts));
+	char *text;
+	size_t i, len;
+	FILE *f = open_memstream(&text, &len);
+
+	if (!f)
+		err(1, "Allocating line text");
+	p->num_parts = tp->num_parts;
+	for (i = 0; i < tp->num_parts; i++) {
+		const struct pattern_part *part = &tp->part[i];
+		const char *s = tp->text + part->off;
+
+		p->part[i] = *part;
+		p->part[i].off = ftell(f);
+		if (part->type == LITERAL) {
+			fwrite(s, 1, part->len, f);
+			continue;
+		}
+		while (cisspace(*s))
+			fputc(*(s++), f);
+		p->part[i].type = types[i];
+		if (types[i] == INTEGER)
+			fprintf(f, "%lli", vals[i].ival);
+		else
+			fprintf(f, "%g", vals[i].dval);
+		fputs(unit_names[part->unit], f);
+		p->part[i].len = ftell(f) - p->part[i].off;
+	}
+	/* get_pattern() ignores trailing whitespace, so we have none. */
+	fclose(f);
+	p->text = text;
+	return p;
+}
+
+void stats_add_values(struct stats *s, long id, const double *vals)
+{
+	struct template *t = &s->tmpl[id];
+	const struct pattern *tp = t->pattern;
+	struct file *info = &s->info;
+	struct pattern *p;
+	union val *v;
+	char *text;
+	size_t i, n = 0;
+
+	match_reserve(info, tp->num_parts);
+	for (i = 0; i < tp->num_parts; i++) {
+		double d;
+
+		if (tp->part[i].type == LITERAL)
+			continue;
+		/* What get_pattern() would make of it, printed with %g. */
+		d = vals[n++];
+		if (d == floor(d) && fabs(d) < 0x1p63) {
+			info->match_types[i] = INTEGER;
+			info->match_vals[i].ival = d;
+		} else {
+			info->match_types[i] = FLOAT;
+			info->match_vals[i].dval = d;
+		}
+	}
+
+	prof_count(COUNT_LINES, 1);
+	/* With --max-patterns, it may have been recycled for another. */
+	if (t->line && (!info->max_patterns || line_eq(t->line, tp))) {
+		uint64_t start = prof_start();
+
+		add_typed_vals(t->line, info->match_vals, info->match_types);
+		prof_next(PHASE_ADD, start);
+		return;
+	}
+
+	/* Otherwise, the same as add_line() after get_pattern(). */
+	p = fill_template(tp, info->match_types, info->match_vals);
+	v = malloc(valsize(tp->num_parts));
+	memcpy(v, info->match_vals, valsize(tp->num_parts));
+	text = (char *)p->text;
+	t->line = add_pattern(info, p, v, t->hash, false);
+	free(text);
+}
+
+static void forget_template_lines(struct stats *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->num_tmpl; i++)
+		s->tmpl[i].line = NULL;
+}
+
+void stats_merge(struct stats *to, struct stats *from)
+{
+	struct prof_span span;
+
+	prof_begin(&span);
+	merge_file(&to->info, &from->info);
+	/* That took its lines, but left it pointing at them. */
+	free_file_info(&from->info);
+	file_init(&from->info, &from->config);
+	forget_template_lines(from);
+	/* And merging can throw away lines with --max-patterns. */
+	forget_template_lines(to);
+	prof_finish(PHASE_MERGE, &span);
+}
+
+void stats_snapshot(struct stats *s, FILE *out)
+{
+	const struct stats_config *config = &s->config;
+	struct file *info = &s->info;
+	struct prof_span span;
+
+	if (prof.enabled) {
+#if HAVE_MALLINFO2
+		struct mallinfo2 mi = mallinfo2();
+
+		if (mi.uordblks > prof.heap_bytes)
+			prof.heap_bytes = mi.uordblks;
+#endif
+		if (spill.used > prof.value_bytes)
+			prof.value_bytes = spill.used;
+	}
+	prof_begin(&span);
+	flush_samples(info);
+	if (info->key_field)
+		group_keyed_lines(info);
+	find_literal_numbers(info);
+	prof_finish(PHASE_LITERALS, &span);
+	prof_begin(&span);
+	derive_lines(info, config->format == STATS_CSV);
+	prof_finish(PHASE_DERIVE, &span);
+	prof_begin(&span);
+	if (config->correlate || config->spearman)
+		correlate_lines(info, config->threads, config->spearman);
+	prof_finish(PHASE_CORRELATE, &span);
+	prof_begin(&span);
+	if (config->format == STATS_CSV)
+		print_csv(out, info, config->show_count,
+			  config->suppress_invariant);
+	else if (config->format == STATS_JSON)
+		print_json(out, info, config->trim_outliers,
+			   config->suppress_invariant, &s->pcts, config->ess);
+	else {
+		print_analysis(out, info, config->trim_outliers,
+			       config->show_count, config->suppress_invariant,
+			       config->ess);
+		if (config->histograms)
+			print_histograms(out, info, config->trim_outliers,
+					 config->suppress_invariant);
+	}
+	prof_finish(PHASE_PRINT, &span);
+	free_derived(info);
+	free_correlations(info);
+	restore_literal_numbers(info);
+	unflush_samples(info);
+}
+
+void stats_free(struct stats *s)
+{
+	size_t i;
+
+	if (!s)
+		return;
+	free_file_info(&s->info);
+	for (i = 0; i < s->num_tmpl; i++) {
+		free((char *)s->tmpl[i].pattern->text);
+		free(s->tmpl[i].pattern);
+	}
+	free(s->tmpl);
+	free(s->pcts.pct);
+	free(s->fields);
+	free_strings(s->match, s->config.num_match);
+	free_strings(s->exclude, s->config.num_exclude);
+	free_strings(s->derive, s->config.num_derive);
+	free(s);
+}
@@ -1,776 +1,504 @@
 /* Licensed under GPLv3 (or any later version) - see LICENSE file for details */
 #include <ccan/err/err.h>
 #include <ccan/opt/opt.h>
-#include <ccan/rbuf/rbuf.h>
-#include <ccan/htable/htable_type.h>
-#include <ccan/hash/hash.h>
-#include <ccan/list/list.h>
 #include <ccan/str/str.h>
-#include <ccan/tally/tally.h>
-#include <unistd.h>
-#include <limits.h>
-#include <float.h>
+#include "stats.h"
+#include <pthread.h>
 #include <errno.h>
-#include <math.h>
-
-enum pattern_type {
-	LITERAL,
-	INTEGER,
-	FLOAT,
-	/* These are parsing states. */
-	PRESPACES,
-	TERM
-};
-
-union val {
-	long long ival;
-	double dval;
-};
-
-struct pattern_part {
-	enum pattern_type type;
-	size_t off, len;
-};
-
-struct pattern {
-	const char *text;
-	size_t num_parts;
-	struct pattern_part part[ /* num_parts */ ];
-};
-
-struct values {
-	struct list_node list;
-	union val vals[ /* num_parts */ ];
-};
-
-struct line {
-	struct list_node list;
-	struct pattern *pattern;
-	long long count;
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
-	struct list_head vals;
+/* Requested percentiles, as 0-100. */
+struct percentiles {
+	size_t num;
+	double *pct;
 };
 
-static const struct pattern *line_key(const struct line *line)
-{
-	return line->pattern;
-}
-
-static size_t pattern_hash(const struct pattern *p)
+static char *opt_add_percentiles(const char *arg, struct percentiles *pcts)
 {
-	size_t i;
-	size_t h = p->num_parts;
-
-	for (i = 0; i < p->num_parts; i++) {
-		const struct pattern_part *part = &p->part[i];
-
-		if (part->type == LITERAL)
-			h = hash(p->text + part->off, part->len, h);
-	}
-	return h;
-}
+	const char *p = arg;
 
-static bool line_eq(const struct line *line, const struct pattern *p)
-{
-	const struct pattern *p2 = line->pattern;
-	size_t i;
+	do {
+		char *end;
+		double d = strtod(p, &end);
 
-	if (p->num_parts != p2->num_parts)
-		return false;
-	for (i = 0; i < p->num_parts; i++) {
-		const struct pattern_part *part1 = &p->part[i];
-		const struct pattern_part *part2 = &p2->part[i];
-
-		if (part1->type == LITERAL) {
-			if (part2->type != LITERAL)
-				return false;
-			if (part1->len != part2->len)
-				return false;
-			if (strncmp(p->text + part1->off,
-				    p2->text + part2->off,
-				    part1->len))
-				return false;
-		} else if (part2->type == LITERAL)
-			return false;
-	}
-	return true;
+		if (end == p || (*end && *end != ',') || d < 0 || d > 100)
+			return opt_invalid_argument(arg);
+		pcts->pct = realloc(pcts->pct,
+				    sizeof(pcts->pct[0]) * (pcts->num + 1));
+		pcts->pct[pcts->num++] = d;
+		p = end + 1;
+	} while (p[-1] == ',');
+	return NULL;
 }
 
-HTABLE_DEFINE_TYPE(struct line, line_key, pattern_hash, line_eq, linehash);
-
-struct file {
-	struct list_head lines;
-	struct linehash patterns;
+/* Which numbers of each line --fields wants, from 1. */
+struct fields {
+	size_t num;
+	unsigned *field;
 };
 
-static inline size_t partsize(size_t num)
-{
-	return sizeof(struct pattern) + sizeof(struct pattern_part) * num;
-}
-
-static inline size_t valsize(size_t num)
+static char *opt_add_fields(const char *arg, struct fields *fields)
 {
-	return sizeof(struct values) + sizeof(union val) * num;
-}
-
-static void add_part(struct pattern **p, struct values **vals,
-		     const struct pattern_part *part, const union val *v,
-		     size_t *max_parts)
-{
-	if ((*p)->num_parts == *max_parts) {
-		*max_parts *= 2;
-		*p = realloc(*p, partsize(*max_parts));
-		*vals = realloc(*vals, valsize(*max_parts));
-	}
-	(*vals)->vals[(*p)->num_parts] = *v;
-	(*p)->part[(*p)->num_parts++] = *part;
-}
-
-/* We want "finished in100 seconds" to match "finished in  5 seconds". */
-struct pattern *get_pattern(const char *line,
-			    unsigned skip,
-			    struct values **vals)
-{
-	enum pattern_type state = LITERAL;
-	size_t len, i, max_parts = 3;
-	struct pattern_part part;
-	struct pattern *p;
-
-	*vals = malloc(valsize(max_parts));
-	p = malloc(partsize(max_parts));
-	p->text = line;
-	p->num_parts = 0;
-
-	for (i = len = 0; state != TERM; i++, len++) {
-		enum pattern_type old_state = state;
-		bool starts_num;
-		union val v;
-
-		starts_num = (line[i] == '-' && cisdigit(line[i+1]))
-			|| cisdigit(line[i]);
-
-		switch (state) {
-		case LITERAL:
-			if (starts_num) {
-				state = INTEGER;
-				break;
-			} else if (cisspace(line[i])) {
-				state = PRESPACES;
-				break;
-			}
-			break;
-		case PRESPACES:
-			if (starts_num) {
-				state = INTEGER;
-				break;
-			} else if (!cisspace(line[i])) {
-				state = LITERAL;
-			}
-			break;
-		case INTEGER:
-			if (line[i] == '.') {
-				if (cisdigit(line[i+1])) {
-					/* Was float all along... */
-					state = old_state = FLOAT;
-				} else
-					state = LITERAL;
-				break;
-			}
-			/* fall thru */
-		case FLOAT:
-			if (cisspace(line[i])) {
-				state = PRESPACES;
-				break;
-			} else if (!cisdigit(line[i])) {
-				state = LITERAL;
-				break;
-			}
-			break;
-		case TERM:
-			abort();
-		}
-
-		if (!line[i])
-			state = TERM;
-
-		if (state == old_state)
-			continue;
-
-		part.type = old_state;
-		part.len = len;
-		part.off = i - len;
-		/* Make sure identical values memcmp in find_literal_numbers  */
-		memset(&v, 0, sizeof(v));
-
-		if (old_state == FLOAT || old_state == INTEGER) {
-			if (skip) {
-				old_state = LITERAL;
-				skip--;
-			}
-		}
-
-		if (old_state == FLOAT) {
-			char *end;
-			v.dval = strtod(line + part.off, &end);
-			if (end != line + i) {
-				warnx("Could not parse float '%.*s'",
-				      (int)len, line + i - len);
-			} else {
-				add_part(&p, vals, &part, &v, &max_parts);
-			}
-			len = 0;
-		} else if (old_state == INTEGER) {
-			char *end;
-			v.ival = strtoll(line + part.off, &end, 10);
-			if (end != line + i) {
-				warnx("Could not parse integer '%.*s'",
-				      (int)len, line + i - len);
-			} else {
-				add_part(&p, vals, &part, &v, &max_parts);
-			}
-			len = 0;
-		} else if (old_state == LITERAL && len > 0) {
-			/* Since we can go to PRESPACES and back, we can
-			 * have successive literals.  Collapse them. */
-			if (p->num_parts > 0
-			    && p->part[p->num_parts-1].type == LITERAL) {
-				p->part[p->num_parts-1].len += len;
-				len = 0;
-				continue;
-			}
-			add_part(&p, vals, &part, &v, &max_parts);
-			len = 0;
-		}
-	}
-	return p;
-}
+	const char *p = arg;
 
-static void val_to_float(union val *val)
-{
-	val->dval = val->ival;
-}
+	do {
+		char *end;
+		unsigned long n = strtoul(p, &end, 10);
+
+		if (end == p || (*end && *end != ',') || n == 0 || n > UINT_MAX)
+			return opt_invalid_argument(arg);
+		fields->field = realloc(fields->field,
+					sizeof(fields->field[0])
+					* (fields->num + 1));
+		fields->field[fields->num++] = n;
+		p = end + 1;
+	} while (p[-1] == ',');
+	return NULL;
+}
+
+/* Strings for --match or --exclude. */
+struct strings {
+	size_t num;
+	const char **str;
+};
 
-static void add_stats(struct line *line, struct pattern *p, struct values *vals)
+static char *opt_add_string(const char *arg, struct strings *strs)
 {
-	size_t i;
-
-	for (i = 0; i < p->num_parts; i++) {
-		if (p->part[i].type == LITERAL)
-			continue;
-		if (p->part[i].type == FLOAT
-		    && line->pattern->part[i].type == INTEGER) {
-			struct values *v;
-
-			/* Convert all previous entries to float. */
-			list_for_each(&line->vals, v, list)
-				val_to_float(&v->vals[i]);
-			line->pattern->part[i].type = FLOAT;
-		} else if (p->part[i].type == INTEGER
-			   && line->pattern->part[i].type == FLOAT) {
-			val_to_float(&vals->vals[i]);
-			p->part[i].type = FLOAT;
-		}
-		assert(p->part[i].type == line->pattern->part[i].type);
-	}
-	free(p);
-	list_add_tail(&line->vals, &vals->list);
-	line->count++;
+	strs->str = realloc(strs->str, sizeof(strs->str[0]) * (strs->num + 1));
+	strs->str[strs->num++] = arg;
+	return NULL;
 }
 
-static void add_line(struct file *info, unsigned skip, const char *str)
+static char *opt_add_derive(const char *arg, struct strings *strs)
 {
-	struct line *line;
-	struct pattern *p;
-	struct values *vals;
-
-	p = get_pattern(str, skip, &vals);
+	const char *error = stats_check_derive(arg, strs->num, strs->str);
+	char *msg;
 
-	line = linehash_get(&info->patterns, p);
-	if (line) {
-		add_stats(line, p, vals);
-	} else {
-		/* We need to keep a copy of this! */
-		p->text = strdup(p->text);
-		line = malloc(sizeof(*line));
-		line->pattern = p;
-		line->count = 1;
-		list_head_init(&line->vals);
-		list_add(&line->vals, &vals->list);
-		linehash_add(&info->patterns, line);
-		list_add_tail(&info->lines, &line->list);
+	if (error) {
+		msg = malloc(strlen(arg) + strlen(error) + sizeof("'': "));
+		sprintf(msg, "'%s': %s", arg, error);
+		return msg;
 	}
+	return opt_add_string(arg, strs);
 }
 
-static void print_literal_part(const struct pattern *p, size_t off)
-{
-	printf("%.*s", (int)p->part[off].len, p->text + p->part[off].off);
-}
-
-static bool spacestart(const struct pattern *p, size_t off)
-{
-	return cisspace(p->text[p->part[off].off]);
-}
-
-static inline bool greater_double(union val v1, union val v2)
+static char *opt_set_csv(enum stats_format *format)
 {
-	return v1.dval > v2.dval;
+	*format = STATS_CSV;
+	return NULL;
 }
 
-static inline union val add_double(union val v1, union val v2)
+static char *opt_set_numbers(const char *arg, unsigned *forms)
 {
-	union val v;
-	v.dval = v1.dval + v2.dval;
-	return v;
-}
-
-static inline union val sub_double(union val v1, union val v2)
-{
-	union val v;
-	v.dval = v1.dval - v2.dval;
-	return v;
-}
-
-static inline union val div_double(union val v, size_t num)
-{
-	v.dval /= num;
-	return v;
-}
-
-static inline double double_to_double(union val v)
-{
-	return v.dval;
-}
+	static const struct {
+		const char *name;
+		unsigned forms;
+	} names[] = {
+		{ "hex", STATS_NUMBERS_HEX },
+		{ "exp", STATS_NUMBERS_EXP },
+		{ "units", STATS_NUMBERS_UNITS },
+		{ "thousands", STATS_NUMBERS_THOUSANDS },
+		{ "all", STATS_NUMBERS_HEX | STATS_NUMBERS_EXP
+			 | STATS_NUMBERS_UNITS | STATS_NUMBERS_THOUSANDS },
+	};
+	const char *p = arg;
+	size_t i, len;
 
-static inline void print_double(union val val)
-{
-	printf("%lf", val.dval);
-}
-
-static inline bool greater_int(union val v1, union val v2)
-{
-	return v1.ival > v2.ival;
-}
+	do {
+		len = strcspn(p, ",");
+		for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+			if (strlen(names[i].name) == len
+			    && strncmp(p, names[i].name, len) == 0)
+				break;
+		if (i == sizeof(names) / sizeof(names[0]))
+			return opt_invalid_argument(arg);
+		*forms |= names[i].forms;
+		p += len + 1;
+	} while (p[-1] == ',');
+	return NULL;
+}
+
+static char *opt_set_format(const char *arg, enum stats_format *format)
+{
+	if (streq(arg, "text"))
+		*format = STATS_TEXT;
+	else if (streq(arg, "csv"))
+		*format = STATS_CSV;
+	else if (streq(arg, "json"))
+		*format = STATS_JSON;
+	else
+		return opt_invalid_argument(arg);
+	return NULL;
+}
+
+struct options {
+	struct stats_config config;
+	struct percentiles pcts;
+	struct fields fields;
+	struct strings match, exclude, derive;
+	unsigned jobs;
+	bool aggregate;
+	unsigned long max_memory;
+	bool compress;
+	bool profile;
+	bool perf_counters;
+};
 
-static inline union val add_int(union val v1, union val v2)
-{
-	union val v;
-	v.ival = v1.ival + v2.ival;
-	return v;
-}
+/*
+ * With -j, files are analyzed on a pool of workers.  Each worker starts
+ * with every Nth file and takes from the front of its own queue; once
+ * that is empty it steals from the back of the others'.  Output goes to
+ * a memory buffer, which main() writes out in command-line order.  With
+ * --aggregate, workers keep what they read instead, and main() merges
+ * them in command-line order.
+ */
+struct job {
+	const char *name;
+	struct stats *stats;
+	char *output;
+	size_t output_len;
+	int errnum;
+	const char *what;
+	bool done;
+};
 
-static inline union val sub_int(union val v1, union val v2)
-{
-	union val v;
-	v.ival = v1.ival - v2.ival;
-	return v;
-}
+struct job_queue {
+	pthread_mutex_t lock;
+	size_t *job;
+	size_t head, tail;
+};
 
-static inline union val div_int(union val v, size_t num)
-{
-	v.ival /= num;
-	return v;
-}
+struct pool {
+	const struct options *opts;
+	struct job *jobs;
+	struct job_queue *queue;
+	unsigned num_workers;
 
-static inline double int_to_double(union val v)
-{
-	return (double)v.ival;
-}
+	pthread_mutex_t lock;
+	/* Signalled whenever a job is done. */
+	pthread_cond_t done;
+};
 
-static inline void print_int(union val val)
-{
-	printf("%lli", val.ival);
-}
+struct worker {
+	struct pool *pool;
+	unsigned id;
+};
 
-static void analyze_vals(const struct list_head *vals, const struct pattern *p,
-			 size_t off,
-			 bool (*greater)(union val v1, union val v2),
-			 union val (*add)(union val v1, union val v2),
-			 union val *min, union val *max, union val *tot,
-			 size_t *num)
+static bool job_queue_pop(struct job_queue *q, bool front, size_t *job)
 {
-	struct values *v;
+	bool ret = false;
 
-	v = list_top(vals, struct values, list);
-	*num = 0;
-	list_for_each(vals, v, list) {
-		if (!*num) {
-			*min = *max = *tot = v->vals[off];
-		} else {
-			if (greater(*min, v->vals[off]))
-				*min = v->vals[off];
-			else if (greater(v->vals[off], *max))
-				*max = v->vals[off];
-			*tot = add(*tot, v->vals[off]);
-		}
-		(*num)++;
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		if (front)
+			*job = q->job[q->head++];
+		else
+			*job = q->job[--q->tail];
+		ret = true;
 	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
 }
 
-static void print_one(const struct pattern *p, size_t off,
-		      union val *min, union val *max,
-		      double avg, double stddev,
-		      void (*print)(union val v))
-{
-	if (spacestart(p, off))
-		fputc(' ', stdout);
-	print(*min);
-	fputc('-', stdout);
-	print(*max);
-	printf("(%g+/-%.2g)", avg, stddev);
-}
-
-static double get_stddev(const struct list_head *vals, size_t off,
-			 double avg, union val min, union val max,
-			 bool trim_out,
-			 double (*to_double)(union val v))
+static bool next_job(struct pool *pool, unsigned id, size_t *job)
 {
-	struct values *v;
-	double variance = 0.0;
-	unsigned num = 0;
-
-	list_for_each(vals, v, list) {
-		double d = to_double(v->vals[off]);
-		variance += (d - avg) * (d - avg);
-		num++;
-	}
+	unsigned i;
 
-	if (trim_out) {
-		double d = to_double(min);
-		variance -= (d - avg) * (d - avg);
-		d = to_double(max);
-		variance -= (d - avg) * (d - avg);
-		num -= 2;
+	if (job_queue_pop(&pool->queue[id], true, job))
+		return true;
+	for (i = 1; i < pool->num_workers; i++) {
+		unsigned victim = (id + i) % pool->num_workers;
+		if (job_queue_pop(&pool->queue[victim], false, job))
+			return true;
 	}
-
-	return sqrt(variance / num);
-}
-
-static void print_val(const struct list_head *vals, const struct pattern *p,
-		      size_t off,
-		      bool trim_out,
-		      bool (*greater)(union val v1, union val v2),
-		      union val (*add)(union val v1, union val v2),
-		      union val (*sub)(union val v1, union val v2),
-		      union val (*div)(union val v, size_t num),
-		      double (*to_double)(union val v),
-		      void (*print)(union val v))
-{
-	size_t num;
-	union val min, max, tot;
-	double avg, stddev;
-
-	analyze_vals(vals, p, off, greater, add, &min, &max, &tot, &num);
-	if (num < 3)
-		trim_out = false;
-	if (trim_out) {
-		tot = sub(tot, max);
-		tot = sub(tot, min);
-		avg = to_double(tot) / (num - 2);
-	} else
-		avg = to_double(tot) / num;
-
-	stddev = get_stddev(vals, off, avg, min, max, trim_out, to_double);
-	print_one(p, off, &min, &max, avg, stddev, print);
-}
-
-/* Numbers which are always the same are actually literals. */
-static void find_literal_numbers(struct file *info)
-{
-	struct line *l;
-	struct values *v;
-
-	list_for_each(&info->lines, l, list) {
-		size_t i;
-
-		for (i = 0; i < l->pattern->num_parts; i++) {
-			struct values *first = NULL;
-			if (l->pattern->part[i].type == LITERAL)
-				continue;
-			list_for_each(&l->vals, v, list) {
-				if (!first) {
-					first = v;
-					continue;
-				}
-				if (memcmp(&first->vals[i], &v->vals[i],
-					   sizeof(v->vals[i])) != 0) {
-					first = NULL;
-					break;
-				}
-			}
-
-			/* first is cleared iff we found a mismatch.  */
-			if (first)
-				l->pattern->part[i].type = LITERAL;
+	return false;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct pool *pool = w->pool;
+	size_t n;
+
+	while (next_job(pool, w->id, &n)) {
+		struct job *job = &pool->jobs[n];
+
+		job->stats = stats_new(&pool->opts->config);
+		job->errnum = stats_read(job->stats, job->name, &job->what);
+		if (!pool->opts->aggregate) {
+			FILE *out = open_memstream(&job->output,
+						   &job->output_len);
+			if (!out)
+				err(1, "Allocating output buffer");
+			if (!job->errnum)
+				stats_snapshot(job->stats, out);
+			fclose(out);
+			stats_free(job->stats);
+			job->stats = NULL;
 		}
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
 	}
+	return NULL;
 }
 
-static bool suppress(const struct line *l, bool suppress_inv)
+/* If @total is non-NULL, merge into that instead of printing. */
+static void process_files_parallel(char *names[], size_t num,
+				   const struct options *opts,
+				   struct stats *total)
 {
+	struct pool pool;
+	struct worker *workers;
+	pthread_t *threads;
 	size_t i;
 
-	if (!suppress_inv)
-		return false;
-
-	for (i = 0; i < l->pattern->num_parts; i++)
-		if (l->pattern->part[i].type != LITERAL)
-			return false;
-
-	/* All literals, so this line is invariant. */
-	return true;
-}
-
-static void print_analysis(const struct file *info, bool trim_outliers,
-			   bool show_count, bool suppress_inv)
-{
-	struct line *l;
-
-	list_for_each(&info->lines, l, list) {
-		size_t i;
-
-		if (suppress(l, suppress_inv))
-			continue;
-
-		for (i = 0; i < l->pattern->num_parts; i++) {
-			switch (l->pattern->part[i].type) {
-			case LITERAL:
-				print_literal_part(l->pattern, i);
-				break;
-			case FLOAT:
-				print_val(&l->vals, l->pattern, i,
-					  trim_outliers,
-					  greater_double, add_double, sub_double,
-					  div_double, double_to_double,
-					  print_double);
-				break;
-			case INTEGER:
-				print_val(&l->vals, l->pattern, i,
-					  trim_outliers,
-					  greater_int, add_int, sub_int,
-					  div_int, int_to_double, print_int);
-				break;
-			default:
-				abort();
-			}
-		}
+	pool.opts = opts;
+	pool.num_workers = opts->jobs < num ? opts->jobs : num;
+	pool.jobs = calloc(num, sizeof(*pool.jobs));
+	pool.queue = calloc(pool.num_workers, sizeof(*pool.queue));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	for (i = 0; i < pool.num_workers; i++) {
+		pthread_mutex_init(&pool.queue[i].lock, NULL);
+		pool.queue[i].job = malloc(sizeof(size_t)
+					   * (num / pool.num_workers + 1));
+	}
+	for (i = 0; i < num; i++) {
+		struct job_queue *q = &pool.queue[i % pool.num_workers];
+		pool.jobs[i].name = names[i];
+		q->job[q->tail++] = i;
+	}
 
-		if (show_count) {
-			printf("  (%lli)", l->count);
-		}
-		fputc('\n', stdout);
+	workers = malloc(sizeof(*workers) * pool.num_workers);
+	threads = malloc(sizeof(*threads) * pool.num_workers);
+	for (i = 0; i < pool.num_workers; i++) {
+		workers[i].pool = &pool;
+		workers[i].id = i;
+		if (pthread_create(&threads[i], NULL, worker_thread,
+				   &workers[i]) != 0)
+			err(1, "Creating worker thread");
 	}
-}
 
-static void print_literal_noquote(const struct pattern *p, size_t off)
-{
-	size_t i;
+	for (i = 0; i < num; i++) {
+		struct job *job = &pool.jobs[i];
 
-	for (i = p->part[off].off; i < p->part[off].off + p->part[off].len; i++)
-		if (p->text[i] != '"')
-			fputc(p->text[i], stdout);
-}
+		pthread_mutex_lock(&pool.lock);
+		while (!job->done)
+			pthread_cond_wait(&pool.done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
 
-static void print_graph(const struct line *line, size_t field, bool trim_outliers)
-{
-	struct tally *tally = tally_new(10000);
-	struct values *v;
-
-	if (line->pattern->part[field].type == FLOAT) {
-		double min = DBL_MAX, max = DBL_MIN, scale;
-
-		/* Tally does integers, so we need to normalize to percentages. */
-		list_for_each(&line->vals, v, list) {
-			if (v->vals[field].dval > max)
-				max = v->vals[field].dval;
-			if (v->vals[field].dval < min)
-				min = v->vals[field].dval;
+		if (job->errnum) {
+			errno = job->errnum;
+			err(1, "%s %s", job->what, job->name);
 		}
-		printf(" (%f-%f, graphed as percentiles)\n", min, max);
-		scale = (max - min) / 100;
-
-		list_for_each(&line->vals, v, list)
-			tally_add(tally, (v->vals[field].dval - min) / scale);
-	} else {
-		assert(line->pattern->part[field].type == INTEGER);
-		printf("\n");
-		list_for_each(&line->vals, v, list)
-			tally_add(tally, v->vals[field].ival);
-	}
-	printf("%s", tally_histogram(tally, 78, 25));
-}
-
-static void print_histograms(const struct file *info, bool trim_outliers,
-			     bool suppress_inv)
-{
-	struct line *l;
-	size_t i;
-	bool first_line = true, printed_graph, printed_literal;
-
-	list_for_each(&info->lines, l, list) {
-		if (suppress(l, suppress_inv))
-			continue;
-
-		if (!first_line)
-			fputc('\n', stdout);
-		first_line = false;
-		printed_graph = false;
-		printed_literal = false;
-
-		for (i = 0; i < l->pattern->num_parts; i++) {
-			if (printed_graph)
-				printf("\n...");
-			if (l->pattern->part[i].type == LITERAL) {
-				print_literal_part(l->pattern, i);
-				printed_graph = false;
-				printed_literal = true;
-			} else {
-				printf("%s[GRAPH]:", (printed_literal ? " " : ""));
-				print_graph(l, i, trim_outliers);
-				printed_graph = true;
-				printed_literal = false;
-			}
+		if (total) {
+			stats_merge(total, job->stats);
+			stats_free(job->stats);
+		} else {
+			fwrite(job->output, 1, job->output_len, stdout);
+			free(job->output);
 		}
 	}
-}
 
-static void print_csv(const struct file *info, bool show_count,
-		      bool suppress_inv)
-{
-	struct line *l;
-	struct values *v;
-	size_t i, num = 1;
-	bool first_line = true;
-
-	list_for_each(&info->lines, l, list) {
-		if (suppress(l, suppress_inv))
-			continue;
-
-		if (!first_line)
-			fputc('\n', stdout);
-		first_line = false;
-
-		/* First print the header */
-		fputc('"', stdout);
-		for (i = 0; i < l->pattern->num_parts; i++) {
-			if (l->pattern->part[i].type == LITERAL)
-				print_literal_noquote(l->pattern, i);
-			else
-				printf("%s[%zu]", (i > 0 ? " " : ""), num++);
-		}
-		fputc('"', stdout);
-		if (show_count) {
-			printf("  (%lli)", l->count);
-		}
-		fputc('\n', stdout);
-
-		/* Now print values */
-		list_for_each(&l->vals, v, list) {
-			bool printed = false;
-			for (i = 0; i < l->pattern->num_parts; i++) {
-				switch (l->pattern->part[i].type) {
-				case FLOAT:
-					if (printed)
-						fputc(',', stdout);
-					print_double(v->vals[i]);
-					printed = true;
-					break;
-				case INTEGER:
-					if (printed)
-						fputc(',', stdout);
-					print_int(v->vals[i]);
-					printed = true;
-					break;
-				default:
-					break;
-				}
-			}
-			if (printed)
-				fputc('\n', stdout);
-		}
+	for (i = 0; i < pool.num_workers; i++) {
+		pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&pool.queue[i].lock);
+		free(pool.queue[i].job);
 	}
+	free(threads);
+	free(workers);
+	free(pool.queue);
+	free(pool.jobs);
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.lock);
 }
 
-static void free_file_info(struct file *info)
-{
-	struct line *l;
-
-	while ((l = list_pop(&info->lines, struct line, list)) != NULL) {
-		struct values *v;
-		while ((v = list_pop(&l->vals, struct values, list)) != NULL)
-			free(v);
-		free((char *)l->pattern->text);
-		free(l->pattern);
-		free(l);
-	}
-
-	linehash_clear(&info->patterns);
-}	
-
 int main(int argc, char *argv[])
 {
-	bool trim_outliers = false;
-	bool csv = false;
-	unsigned skip = 0;
-	bool show_count = false;
-	bool suppress_inv = false;
-	bool histograms = false;
-
-	opt_register_noarg("--trim-outliers", opt_set_bool, &trim_outliers,
+	struct options opts = {
+		.config = { .format = STATS_TEXT },
+		.pcts = { 0, NULL },
+		.fields = { 0, NULL },
+		.match = { 0, NULL },
+		.exclude = { 0, NULL },
+		.derive = { 0, NULL },
+		.jobs = 1,
+	};
+
+	opt_register_noarg("--trim-outliers", opt_set_bool,
+			   &opts.config.trim_outliers,
 			   "Remove max and min results from average");
-	opt_register_noarg("--csv", opt_set_bool, &csv,
+	opt_register_noarg("--csv", opt_set_csv, &opts.config.format,
 			   "Output results as csv");
-	opt_register_arg("--skip", opt_set_uintval, opt_show_uintval, &skip,
-			   "Treat the first N numeric fields as text");
-	opt_register_noarg("-c|--count", opt_set_bool, &show_count,
+	opt_register_arg("--format", opt_set_format, NULL, &opts.config.format,
+			 "Output format: text, csv or json (one object per line)");
+	opt_register_arg("--percentiles", opt_add_percentiles, NULL,
+			 &opts.pcts,
+			 "Comma-separated percentiles to add to json output");
+	opt_register_arg("--derive", opt_add_derive, NULL, &opts.derive,
+			 "Add a field NAME=EXPRESSION for each row, eg. "
+			 "rate=[1]/[2] (numbers as --fields counts them)");
+	opt_register_arg("--skip", opt_set_uintval, opt_show_uintval,
+			 &opts.config.skip,
+			 "Treat the first N numeric fields as text");
+	opt_register_arg("--fields", opt_add_fields, NULL, &opts.fields,
+			 "Only analyze these comma-separated numbers of each "
+			 "line (from 1, as --csv shows them): the rest match "
+			 "any number");
+	opt_register_arg("--key-field", opt_set_uintval, opt_show_uintval,
+			 &opts.config.key_field,
+			 "Give each value of the Nth number of a line (from 1, "
+			 "as --fields counts them) a line of its own, printed "
+			 "together (and not limited by --max-patterns)");
+	opt_register_arg("--match", opt_add_string, NULL, &opts.match,
+			 "Only analyze lines containing this string (or any of "
+			 "them, if given more than once: many are checked in "
+			 "one pass over each line)");
+	opt_register_arg("--exclude", opt_add_string, NULL, &opts.exclude,
+			 "Ignore lines containing this string (can be given "
+			 "more than once)");
+	opt_register_arg("--numbers", opt_set_numbers, NULL, &opts.config.numbers,
+			 "Also recognize these comma-separated number forms: "
+			 "hex (0x1f), exp (1.5e6), units (12ms, 3.2GiB: "
+			 "scaled to ns or B), thousands (1,234,567), or all");
+	opt_register_arg("--threads", opt_set_uintval, opt_show_uintval,
+			 &opts.config.threads,
+			 "Tokenize input on N threads besides reader and main");
+	opt_register_noarg("--io-uring", opt_set_bool, &opts.config.io_uring,
+			   "Read input using io_uring, with large reads ahead");
+	opt_register_arg("--read-buffer-max", opt_set_ulongval_bi,
+			 opt_show_ulongval_bi, &opts.config.read_buffer_max,
+			 "Fail on lines which need a bigger read buffer "
+			 "than this (0 = no limit)");
+	opt_register_arg("--max-memory", opt_set_ulongval_bi,
+			 opt_show_ulongval_bi, &opts.max_memory,
+			 "Keep values beyond this in a temporary file "
+			 "(0 = no limit)");
+	opt_register_noarg("--compress", opt_set_bool, &opts.compress,
+			   "Keep values delta-encoded in memory (smaller)");
+	opt_register_arg("--sample", opt_set_ulongval, opt_show_ulongval,
+			 &opts.config.sample,
+			 "Keep a random sample of N rows for each line "
+			 "(min, max and mean stay exact)");
+	opt_register_arg("--max-patterns", opt_set_ulongval, opt_show_ulongval,
+			 &opts.config.max_patterns,
+			 "Keep only the N most frequent patterns, counting "
+			 "the rest as [other] (0 = no limit)");
+	opt_register_arg("-j|--jobs", opt_set_uintval, opt_show_uintval,
+			 &opts.jobs,
+			 "Analyze up to N files at once (output is unchanged)");
+	opt_register_noarg("--aggregate", opt_set_bool, &opts.aggregate,
+			   "Analyze all the input files together, as one");
+	opt_register_noarg("-c|--count", opt_set_bool, &opts.config.show_count,
 			   "Print number of occurences for each line");
-	opt_register_noarg("--suppress-invariant", opt_set_bool, &suppress_inv,
+	opt_register_noarg("--suppress-invariant", opt_set_bool,
+			   &opts.config.suppress_invariant,
 			   "Discard lines without varying numbers");
-	opt_register_noarg("--histogram", opt_set_bool, &histograms,
+	opt_register_noarg("--histogram", opt_set_bool, &opts.config.histograms,
 			   "Display histogram(s) of values");
+	opt_register_noarg("--correlate", opt_set_bool, &opts.config.correlate,
+			   "Print the correlation matrix of each line's numbers");
+	opt_register_noarg("--spearman", opt_set_bool, &opts.config.spearman,
+			   "Add Spearman (rank) correlation to --correlate "
+			   "(implies it)");
+	opt_register_noarg("--ess", opt_set_bool, &opts.config.ess,
+			   "Print the effective sample size of each number, and "
+			   "the standard error of its mean, allowing for "
+			   "correlation between successive values");
+	opt_register_noarg("--profile", opt_set_bool, &opts.profile,
+			   "Print time spent in each phase, and counts of "
+			   "what was done, to stderr");
+	opt_register_noarg("--perf-counters", opt_set_bool, &opts.perf_counters,
+			   "Like --profile, with IPC and cache, TLB and branch "
+			   "misses per line (where the kernel allows)");
 	opt_register_noarg("-h|--help", opt_usage_and_exit,
 			   "\nA program to print min-max(avg+/-dev) stats "
 			   "in place of numbers in a stream",
 			   "Print this message");
 	opt_parse(&argc, argv, opt_log_stderr_exit);
 
-	if (csv) {
-		if (trim_outliers)
+	if (opts.config.format == STATS_CSV) {
+		if (opts.config.trim_outliers)
 			errx(1, "--trim-outliers has no effect with --csv");
-		if (histograms)
+		if (opts.config.histograms)
 			errx(1, "--histograms has no effect with --csv");
+		if (opts.config.correlate || opts.config.spearman)
+			errx(1, "--correlate has no effect with --csv");
+		if (opts.config.ess)
+			errx(1, "--ess has no effect with --csv");
 	}
-
-	do {
-		struct file info;
-		struct rbuf in;
-		char *str;
-
-		list_head_init(&info.lines);
-		linehash_init(&info.patterns);
-
-		if (argv[1]) {
-			if (!rbuf_open(&in, argv[1], NULL, 0))
-				err(1, "Failed opening %s", argv[1]);
-		} else
-			rbuf_init(&in, STDIN_FILENO, NULL, 0);
-
-		while ((str = rbuf_read_str(&in, '\n', realloc)) != NULL)
-			add_line(&info, skip, str);
-		free(in.buf);
-
-		if (errno)
-			err(1, "Reading %s", argv[1] ? argv[1] : "<stdin>");
-
-		find_literal_numbers(&info);
-		if (csv)
-			print_csv(&info, show_count, suppress_inv);
-		else {
-			print_analysis(&info, trim_outliers, show_count,
-				       suppress_inv);
-			if (histograms)
-				print_histograms(&info, trim_outliers, suppress_inv);
+	if (opts.config.format == STATS_JSON) {
+		if (opts.config.histograms)
+			errx(1, "--histograms has no effect with --format=json");
+		if (opts.config.show_count)
+			errx(1, "--count has no effect with --format=json");
+	} else if (opts.pcts.num)
+		errx(1, "--percentiles only has an effect with --format=json");
+	if (opts.config.ess && opts.config.sample)
+		errx(1, "--ess needs values in order, which --sample loses");
+	if (!opts.jobs)
+		errx(1, "--jobs must be at least 1");
+	opts.config.num_percentiles = opts.pcts.num;
+	opts.config.percentiles = opts.pcts.pct;
+	opts.config.num_fields = opts.fields.num;
+	opts.config.fields = opts.fields.field;
+	opts.config.num_match = opts.match.num;
+	opts.config.match = opts.match.str;
+	opts.config.num_exclude = opts.exclude.num;
+	opts.config.exclude = opts.exclude.str;
+	opts.config.num_derive = opts.derive.num;
+	opts.config.derive = opts.derive.str;
+	stats_set_memory(opts.max_memory, opts.compress);
+	if (opts.perf_counters)
+		stats_set_perf_counters(true);
+	else if (opts.profile)
+		stats_set_profile(true);
+
+	if (opts.aggregate) {
+		struct stats *total = stats_new(&opts.config);
+
+		if (opts.jobs > 1 && argc > 2) {
+			process_files_parallel(argv + 1, argc - 1, &opts,
+					       total);
+		} else {
+			do {
+				const char *what;
+
+				errno = stats_read(total, argv[1], &what);
+				if (errno)
+					err(1, "%s %s", what,
+					    argv[1] ? argv[1] : "<stdin>");
+			} while (argv[1] && (++argv)[1]);
 		}
-		free_file_info(&info);
-	} while (argv[1] && (++argv)[1]);
+		stats_snapshot(total, stdout);
+		stats_free(total);
+	} else if (opts.jobs > 1 && argc > 2) {
+		process_files_parallel(argv + 1, argc - 1, &opts, NULL);
+	} else {
+		do {
+			struct stats *stats = stats_new(&opts.config);
+			const char *what;
+
+			errno = stats_read(stats, argv[1], &what);
+			if (errno)
+				err(1, "%s %s", what,
+				    argv[1] ? argv[1] : "<stdin>");
+			stats_snapshot(stats, stdout);
+			stats_free(stats);
+		} while (argv[1] && (++argv)[1]);
+	}
+	if (opts.profile || opts.perf_counters)
+		stats_print_profile(stderr);
+	free(opts.pcts.pct);
+	free(opts.fields.field);
+	free(opts.match.str);
+	free(opts.exclude.str);
+	free(opts.derive.str);
 	return 0;
 }
@@ -0,0 +1,215 @@
+/* Licensed under GPLv3 (or any later version) - see LICENSE file for details */
+#ifndef STATS_STATS_H
+#define STATS_STATS_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * libstats: collapse repeated lines into min-max(avg+/-dev) summaries.
+ *
+ * This is what the stats(1) command is built on.  Feed it lines of text
+ * with stats_add_line(), or whole files with stats_read(), and print the
+ * summary at any point with stats_snapshot().  A producer which already
+ * has the numbers can register a line once with stats_template(), then
+ * hand over the values with stats_add_values(), without formatting them
+ * as text to be parsed again.
+ */
+struct stats;
+
+/* Number forms for stats_config.numbers, besides plain decimals. */
+#define STATS_NUMBERS_HEX	1	/* 0x1f */
+#define STATS_NUMBERS_EXP	2	/* 1.5e6 */
+#define STATS_NUMBERS_UNITS	4	/* 12ms, 3.2GiB: scaled to ns or B */
+#define STATS_NUMBERS_THOUSANDS	8	/* 1,234,567 */
+
+enum stats_format {
+	STATS_TEXT,
+	STATS_CSV,
+	STATS_JSON
+};
+
+/* Zero (or NULL) for any of these gives the default. */
+struct stats_config {
+	/* Treat the first N numbers of each line as text. */
+	unsigned skip;
+	/* STATS_NUMBERS_* forms to recognize. */
+	unsigned numbers;
+	/* Only analyze these numbers of each line (from 1, after any
+	 * skip): the others match any number, and print as "*". */
+	size_t num_fields;
+	const unsigned *fields;
+	/* Ignore lines without one of these strings (if any are given),
+	 * and lines with one of those, before working out their pattern. */
+	size_t num_match;
+	const char *const *match;
+	size_t num_exclude;
+	const char *const *exclude;
+	/* Group lines by the Nth number (from 1, after any skip): each
+	 * value of it gets a line of its own, printed together with the
+	 * lines for its other values.  With max_patterns, these lines are
+	 * all kept, and don't count towards it. */
+	unsigned key_field;
+	/* Keep a random sample of N rows for each line, instead of all. */
+	size_t sample;
+	/* Keep only the N most frequent lines, counting the rest as other. */
+	size_t max_patterns;
+
+	/* For stats_read(): tokenize on N threads (and for
+	 * stats_snapshot(), correlate on them), use io_uring, and fail
+	 * on lines needing a bigger read buffer than this. */
+	unsigned threads;
+	bool io_uring;
+	size_t read_buffer_max;
+
+	/* For stats_snapshot(). */
+	enum stats_format format;
+	bool trim_outliers;
+	bool show_count;
+	bool suppress_invariant;
+	bool histograms;
+	/* Percentiles (0-100) to add to STATS_JSON output. */
+	size_t num_percentiles;
+	const double *percentiles;
+	/* Print the (Pearson) correlation of each pair of a line's varying
+	 * numbers, and with spearman, that of their ranks too. */
+	bool correlate;
+	bool spearman;
+	/* Print the effective sample size of each number, and the standard
+	 * error of its mean, allowing for correlation between successive
+	 * values (not for sampled lines, which don't keep their order). */
+	bool ess;
+	/* Fields to work out from each row's numbers, and print after
+	 * them, like "rate=[1]/[2]" (see stats_check_derive()). */
+	size_t num_derive;
+	const char *const *derive;
+};
+
+/**
+ * stats_new - create an empty set of lines.
+ * @config: the settings (copied), or NULL for the defaults.
+ */
+struct stats *stats_new(const struct stats_config *config);
+
+/**
+ * stats_check_derive - check a stats_config.derive definition.
+ * @def: the definition, eg. "rate=[1]/[2]".
+ * @num_prev: the number of definitions before it.
+ * @prev: those definitions, which it can't share a name with.
+ *
+ * A definition is a name, '=', then an expression of +, -, *, /,
+ * brackets, numbers and fields: [N] is the Nth number of a line, from
+ * 1 (as stats_config.fields counts them).  A line without all the
+ * fields doesn't get this one, and rows where it isn't finite (dividing
+ * by zero) are left out of it.  stats_new() ignores invalid ones.
+ *
+ * Returns NULL if it's valid, otherwise what's wrong with it.
+ */
+const char *stats_check_derive(const char *def, size_t num_prev,
+			       const char *const *prev);
+
+/**
+ * stats_set_memory - limit the memory used for values.
+ * @max: beyond this, keep values in a temporary file (0 = no limit).
+ * @compress: keep values delta-encoded in memory.
+ *
+ * These apply to every struct stats in the process.
+ */
+void stats_set_memory(size_t max, bool compress);
+
+/**
+ * stats_set_profile - time and count what every struct stats does.
+ * @enable: whether to (this also resets what was counted so far).
+ *
+ * Like stats_set_memory(), this is process-wide.  Costs nothing much
+ * when it's off.
+ */
+void stats_set_profile(bool enable);
+
+/**
+ * stats_set_perf_counters - profile, with hardware counters too.
+ * @enable: whether to (this also resets what was counted so far).
+ *
+ * Does stats_set_profile(), and also counts cycles, instructions, branch,
+ * last-level cache and TLB misses for the phases which aren't per-line,
+ * which stats_print_profile() shows as IPC and misses per line.  Any
+ * counter the kernel won't give us (eg. in a container or VM) is left
+ * out, and stats_print_profile() says why.
+ */
+void stats_set_perf_counters(bool enable);
+
+/**
+ * stats_print_profile - print where the time went.
+ * @out: where to print it.
+ *
+ * Prints the CPU (and, for the phases which aren't per-line, wall)
+ * time of each phase since stats_set_profile(), and counts of lines,
+ * bytes, patterns and so on.  The per-line phases of ingest are timed
+ * by sampling, so they're marked as estimates.
+ */
+void stats_print_profile(FILE *out);
+
+/**
+ * stats_add_line - add a line of text.
+ * @s: the stats.
+ * @line: the nul-terminated line (without the newline).
+ */
+void stats_add_line(struct stats *s, const char *line);
+
+/**
+ * stats_read - add every line of a file.
+ * @s: the stats.
+ * @name: the file name, or NULL for standard input.
+ * @what: set to what we were doing, on failure.
+ *
+ * Compressed files are decompressed.  Returns 0, or an errno value.
+ */
+int stats_read(struct stats *s, const char *name, const char **what);
+
+/**
+ * stats_template - register a line to add values to directly.
+ * @s: the stats.
+ * @example: an example of the line, eg. "took 10 ms".
+ *
+ * Returns the id to hand to stats_add_values(), or -1 if @example has
+ * no numbers in it.  The values are the numbers in @example, in order
+ * (just those stats_config.fields selects, if any, and not the
+ * stats_config.key_field one, which is part of the line).
+ */
+long stats_template(struct stats *s, const char *example);
+
+/**
+ * stats_add_values - add a line from its template and values.
+ * @s: the stats.
+ * @id: the return from stats_template().
+ * @vals: one value for each number in the template.
+ *
+ * This is equivalent to stats_add_line() of the template with these
+ * numbers in it, without printing or parsing them.  Integral values
+ * stay integers as long as all of them are.
+ */
+void stats_add_values(struct stats *s, long id, const double *vals);
+
+/**
+ * stats_merge - add everything in one struct stats to another.
+ * @to: the stats to add to.
+ * @from: the stats to empty into @to (as if read after it).
+ */
+void stats_merge(struct stats *to, struct stats *from);
+
+/**
+ * stats_snapshot - print the summary of what's been added so far.
+ * @s: the stats.
+ * @out: where to print it, in stats_config.format.
+ *
+ * More lines can be added afterwards.
+ */
+void stats_snapshot(struct stats *s, FILE *out);
+
+/**
+ * stats_free - free a struct stats.
+ * @s: the stats (can be NULL).
+ */
+void stats_free(struct stats *s);
+
+#endif /* STATS_STATS_H */
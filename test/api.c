@@ -0,0 +1,82 @@
+/* Test of the libstats API: what stats(1) does, without the command line. */
+#include "stats.h"
+#include <stdio.h>
+
+int main(void)
+{
+	struct stats_config config = { .show_count = true };
+	struct stats *s, *s2;
+	double vals[2];
+	long id, i;
+
+	s = stats_new(&config);
+	stats_add_line(s, "took 10 ms");
+	stats_add_line(s, "took 20 ms");
+	/* No numbers, so no template. */
+	if (stats_template(s, "hello world") != -1)
+		return 1;
+	/* The same line as above, added without text. */
+	id = stats_template(s, "took 0 ms");
+	vals[0] = 30;
+	stats_add_values(s, id, vals);
+	printf("First snapshot:\n");
+	stats_snapshot(s, stdout);
+
+	/* Snapshots don't stop it adding more: this one's a float now. */
+	vals[0] = 0.5;
+	stats_add_values(s, id, vals);
+	id = stats_template(s, "read 1 of 2");
+	for (i = 0; i < 4; i++) {
+		vals[0] = i;
+		vals[1] = 4;
+		stats_add_values(s, id, vals);
+	}
+	printf("Second snapshot:\n");
+	stats_snapshot(s, stdout);
+
+	/* Merge in another one, and print that as csv. */
+	s2 = stats_new(&config);
+	stats_add_line(s2, "took 100 ms");
+	stats_add_line(s2, "new line 7");
+	stats_merge(s, s2);
+	stats_add_line(s2, "took 5 ms");
+	printf("Merged:\n");
+	stats_snapshot(s, stdout);
+	printf("What's left:\n");
+	stats_snapshot(s2, stdout);
+	stats_free(s);
+	stats_free(s2);
+
+	config.format = STATS_CSV;
+	config.sample = 2;
+	s = stats_new(&config);
+	for (i = 0; i < 10; i++) {
+		char line[20];
+
+		sprintf(line, "sample %li 2", i % 2);
+		stats_add_line(s, line);
+	}
+	printf("Sampled csv:\n");
+	stats_snapshot(s, stdout);
+	stats_snapshot(s, stdout);
+	stats_free(s);
+
+	/* Merging can evict the line the next one would be predicted from. */
+	config.format = STATS_TEXT;
+	config.sample = 0;
+	config.max_patterns = 1;
+	s = stats_new(&config);
+	s2 = stats_new(&config);
+	for (i = 0; i < 3; i++)
+		stats_add_line(s, "aa 1");
+	stats_add_line(s, "aa 2");
+	for (i = 0; i < 10; i++)
+		stats_add_line(s2, "bb 1");
+	stats_merge(s, s2);
+	stats_add_line(s, "aa 3");
+	printf("Merged past max_patterns:\n");
+	stats_snapshot(s, stdout);
+	stats_free(s);
+	stats_free(s2);
+	return 0;
+}
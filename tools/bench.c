@@ -0,0 +1,337 @@
+/* End-to-end benchmark of libstats, on synthetic logs.
+ *
+ * Each shape of log is generated (deterministically) into a temporary
+ * file, then analyzed once for each mode, each time in a fresh child
+ * process so its peak RSS is its own.  The child times reading and
+ * printing (to /dev/null), and the parent prints one JSON object per
+ * run, eg:
+ *
+ *   {"shape":"few","mode":"csv","lines":200000,"bytes":5306412,...}
+ *
+ * "bench --generate=SHAPE" writes the log to stdout instead. */
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/str/str.h>
+#include "stats.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* xorshift64*: the same logs on every machine. */
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned rng_below(unsigned n)
+{
+	return rng() % n;
+}
+
+static double rng_double(void)
+{
+	return (rng() >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* A word only letters, so it stays literal: different for each @n. */
+static void put_word(FILE *out, unsigned n)
+{
+	do {
+		fputc('a' + n % 26, out);
+		n /= 26;
+	} while (n);
+}
+
+/* A handful of short lines, repeating, integers only. */
+static void gen_few(FILE *out, size_t n)
+{
+	switch (n % 8) {
+	case 0:
+		fprintf(out, "request %u took %u us\n",
+			rng_below(64), 800 + rng_below(400));
+		break;
+	case 1:
+		fprintf(out, "cache hits %u misses %u\n",
+			90000 + rng_below(1000), rng_below(500));
+		break;
+	case 2:
+		fprintf(out, "queue depth %u\n", rng_below(32));
+		break;
+	case 3:
+		fprintf(out, "gc pause %u ms, freed %u objects\n",
+			1 + rng_below(20), rng_below(100000));
+		break;
+	case 4:
+		fprintf(out, "Using CPUS 0 and 3\n");
+		break;
+	case 5:
+		fprintf(out, "Guest: notified %u, pinged %u\n",
+			156000 + rng_below(600), 156251);
+		break;
+	case 6:
+		fprintf(out, "Host: notified 156251, pinged %u\n",
+			78000 + rng_below(300));
+		break;
+	case 7:
+		fprintf(out, "tick %zu\n", n);
+		break;
+	}
+}
+
+/* Tens of thousands of different lines, each seen a few times. */
+static void gen_many(FILE *out, size_t n)
+{
+	fputs("task ", out);
+	put_word(out, rng_below(50000));
+	fprintf(out, " finished in %u ms (%u retries)\n",
+		rng_below(1000), rng_below(3));
+}
+
+/* A few lines with 32 numbers each. */
+static void gen_wide(FILE *out, size_t n)
+{
+	unsigned i;
+
+	fprintf(out, "sample%c", 'A' + (int)(n % 4));
+	for (i = 0; i < 32; i++)
+		fprintf(out, " %c=%u", 'a' + (i % 26), rng_below(1 << (i % 20)));
+	fputc('\n', out);
+}
+
+/* Floating point almost everywhere. */
+static void gen_float(FILE *out, size_t n)
+{
+	fprintf(out, "iteration %zu: mean %.3f sd %.4f p99 %.2f load %.2f\n",
+		n % 16, 100 * rng_double(), rng_double(),
+		1000 * rng_double(), 4 * rng_double());
+}
+
+/* Mostly different every time: ids, addresses and random words. */
+static void gen_junk(FILE *out, size_t n)
+{
+	fputs("user ", out);
+	put_word(out, rng());
+	fprintf(out, " logged in from %u.%u.%u.%u session 0x%08x id ",
+		rng_below(256), rng_below(256), rng_below(256), rng_below(256),
+		(unsigned)rng());
+	put_word(out, rng());
+	fputc('\n', out);
+}
+
+static const struct shape {
+	const char *name;
+	void (*gen)(FILE *out, size_t n);
+} shapes[] = {
+	{ "few", gen_few },
+	{ "many", gen_many },
+	{ "wide", gen_wide },
+	{ "float", gen_float },
+	{ "junk", gen_junk },
+};
+#define NUM_SHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+static const double pcts[] = { 50, 90, 99 };
+
+/* The command-line modes worth timing separately. */
+static const struct mode {
+	const char *name;
+	struct stats_config config;
+	bool compress;
+} modes[] = {
+	{ "text", { .format = STATS_TEXT } },
+	{ "count", { .show_count = true } },
+	{ "csv", { .format = STATS_CSV } },
+	{ "json", { .format = STATS_JSON, .num_percentiles = 3,
+		    .percentiles = pcts } },
+	{ "histogram", { .histograms = true } },
+	{ "trim-outliers", { .trim_outliers = true } },
+	{ "suppress-invariant", { .suppress_invariant = true } },
+	{ "threads=2", { .threads = 2 } },
+	{ "sample=100", { .sample = 100 } },
+	{ "max-patterns=1000", { .max_patterns = 1000 } },
+	{ "numbers=all", { .numbers = STATS_NUMBERS_HEX | STATS_NUMBERS_EXP
+			   | STATS_NUMBERS_UNITS
+			   | STATS_NUMBERS_THOUSANDS } },
+	{ "compress", { .format = STATS_TEXT }, true },
+};
+#define NUM_MODES (sizeof(modes) / sizeof(modes[0]))
+
+static const struct shape *find_shape(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SHAPES; i++)
+		if (streq(shapes[i].name, name))
+			return &shapes[i];
+	errx(1, "Unknown shape '%s'", name);
+}
+
+static void generate(FILE *out, const struct shape *shape, size_t lines)
+{
+	size_t n;
+
+	rng_state = 0x9E3779B97F4A7C15ULL + (shape - shapes);
+	for (n = 0; n < lines; n++)
+		shape->gen(out, n);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Per-phase times, as the child measured them. */
+struct phases {
+	double read, print, free;
+};
+
+static void run_child(const char *file, const struct mode *mode, int fd)
+{
+	struct phases ph;
+	struct stats *s;
+	const char *what;
+	FILE *null = fopen("/dev/null", "w");
+	double start;
+
+	if (!null)
+		err(1, "Opening /dev/null");
+	stats_set_memory(0, mode->compress);
+	s = stats_new(&mode->config);
+	start = now();
+	errno = stats_read(s, file, &what);
+	if (errno)
+		err(1, "%s %s", what, file);
+	ph.read = now() - start;
+	start = now();
+	stats_snapshot(s, null);
+	fflush(null);
+	ph.print = now() - start;
+	start = now();
+	stats_free(s);
+	ph.free = now() - start;
+	if (write(fd, &ph, sizeof(ph)) != sizeof(ph))
+		err(1, "Writing results");
+	exit(0);
+}
+
+static void run(const char *file, const struct shape *shape,
+		const struct mode *mode, size_t lines, off_t bytes)
+{
+	struct phases ph;
+	struct rusage ru;
+	int fds[2], status;
+	double start, secs;
+	pid_t pid;
+
+	if (pipe(fds) != 0)
+		err(1, "Creating pipe");
+	fflush(stdout);
+	start = now();
+	pid = fork();
+	if (pid < 0)
+		err(1, "Forking");
+	if (pid == 0) {
+		close(fds[0]);
+		run_child(file, mode, fds[1]);
+	}
+	close(fds[1]);
+	if (read(fds[0], &ph, sizeof(ph)) != sizeof(ph))
+		errx(1, "%s/%s: no results from child", shape->name,
+		     mode->name);
+	close(fds[0]);
+	if (wait4(pid, &status, 0, &ru) != pid)
+		err(1, "Waiting for child");
+	secs = now() - start;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(1, "%s/%s: child failed", shape->name, mode->name);
+
+	printf("{\"shape\":\"%s\",\"mode\":\"%s\",\"lines\":%zu,"
+	       "\"bytes\":%lld,\"seconds\":%.6f,\"lines_per_sec\":%.0f,"
+	       "\"mb_per_sec\":%.2f,\"user_sec\":%.6f,\"sys_sec\":%.6f,"
+	       "\"max_rss_kb\":%ld,\"phases\":{\"read\":%.6f,"
+	       "\"print\":%.6f,\"free\":%.6f}}\n",
+	       shape->name, mode->name, lines, (long long)bytes, secs,
+	       lines / secs, bytes / secs / 1e6, tv_secs(&ru.ru_utime),
+	       tv_secs(&ru.ru_stime), ru.ru_maxrss, ph.read, ph.print,
+	       ph.free);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long lines = 200000;
+	char *gen = NULL, *mode_name = NULL;
+	char file[] = "/tmp/stats-bench-XXXXXX";
+	size_t i, j;
+
+	opt_register_arg("--lines", opt_set_ulongval, opt_show_ulongval,
+			 &lines, "Lines of each shape of log");
+	opt_register_arg("--generate", opt_set_charp, NULL, &gen,
+			 "Just write this shape of log to stdout");
+	opt_register_arg("--mode", opt_set_charp, NULL, &mode_name,
+			 "Only run this mode");
+	opt_register_noarg("-h|--help", opt_usage_and_exit,
+			   "[shape...]\nBenchmark libstats on synthetic logs"
+			   " (shapes: few many wide float junk)",
+			   "Print this message");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+
+	if (gen) {
+		generate(stdout, find_shape(gen), lines);
+		return 0;
+	}
+
+	for (i = 0; i < NUM_SHAPES; i++) {
+		const struct shape *shape = &shapes[i];
+		FILE *f;
+		off_t bytes;
+		int fd;
+
+		if (argc > 1) {
+			int a;
+
+			for (a = 1; a < argc; a++)
+				if (streq(argv[a], shape->name))
+					break;
+			if (a == argc)
+				continue;
+		}
+		fd = mkstemp(file);
+		if (fd < 0)
+			err(1, "Creating %s", file);
+		f = fdopen(fd, "w");
+		generate(f, shape, lines);
+		if (fflush(f) != 0)
+			err(1, "Writing %s", file);
+		bytes = ftello(f);
+		fclose(f);
+
+		for (j = 0; j < NUM_MODES; j++) {
+			if (mode_name && !streq(mode_name, modes[j].name))
+				continue;
+			run(file, shape, &modes[j], lines, bytes);
+		}
+		unlink(file);
+		strcpy(file + strlen(file) - 6, "XXXXXX");
+	}
+	return 0;
+}